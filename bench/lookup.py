@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+"""Times calls to a function with n formals whose callee looks one of them
+up through the caller's frame, for growing n, with each interpreter given.
+The time per call shows what binding and indexing a frame and finding a
+symbol in it cost as the number of bindings grows.
+
+    bench/lookup.py build/lispy build/lispy_malloc
+"""
+import os
+import sys
+import tempfile
+
+from run import run
+
+SIZES = [2, 8, 9, 16, 64, 256, 1024]
+CALLS = 20000
+
+
+def script(n):
+    """a script making CALLS calls to a function with n formals"""
+    formals = " ".join("a%d" % i for i in range(n))
+    args = " ".join(str(i) for i in range(n))
+    return "\n".join([
+        "(def {g} (\\ {x} {a0}))",
+        "(def {f} (\\ {%s} {g 0}))" % formals,
+        "(def {loop} (\\ {n acc} {if (== n 0) {acc} {loop (- n 1) (f %s)}}))" % args,
+        "(loop %d 0)" % CALLS,
+        "",
+    ])
+
+
+def main(argv):
+    if not argv:
+        sys.exit(__doc__)
+    print("%-8s %-20s %12s" % ("formals", "lispy", "us per call"))
+    with tempfile.TemporaryDirectory() as tmp:
+        for n in SIZES:
+            path = os.path.join(tmp, "lookup%d.lspy" % n)
+            with open(path, "w") as f:
+                f.write(script(n))
+            for lispy in argv:
+                best = min(run([lispy, path])[0] for _ in range(3))
+                print("%-8d %-20s %12.2f" % (n, os.path.basename(lispy),
+                                             best / CALLS * 1e6))
+
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+"""Runs every bench/*.lspy (or the scripts given after --) with each
+interpreter and prints the best wall time of a few runs, the peak RSS and,
+when perf is installed, the cache misses of one run.
+
+    bench/run.py build/lispy build/lispy_malloc
+    bench/run.py build/lispy -- bench/lists.lspy
+"""
+import glob
+import os
+import shutil
+import subprocess
+import sys
+import time
+
+RUNS = 5
+
+
+def run(cmd):
+    """wall time and peak RSS in KB of one run of cmd"""
+    start = time.perf_counter()
+    p = subprocess.Popen(cmd, stdout=subprocess.DEVNULL)
+    _, status, usage = os.wait4(p.pid, 0)
+    p.returncode = os.waitstatus_to_exitcode(status)
+    if p.returncode != 0:
+        sys.exit("%s exited with %d" % (" ".join(cmd), p.returncode))
+    return time.perf_counter() - start, usage.ru_maxrss
+
+
+def misses(cmd):
+    """cache misses of one run of cmd, or None without perf"""
+    if not shutil.which("perf"):
+        return None
+    out = subprocess.run(["perf", "stat", "-x,", "-e", "cache-misses", "--"] + cmd,
+                         stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                         text=True).stderr
+    for line in out.splitlines():
+        fields = line.split(",")
+        if len(fields) > 2 and fields[2].startswith("cache-misses"):
+            return fields[0]
+    return None
+
+
+def main(argv):
+    if "--" in argv:
+        split = argv.index("--")
+        lispys, scripts = argv[:split], argv[split + 1:]
+    else:
+        here = os.path.dirname(os.path.abspath(__file__))
+        lispys, scripts = argv, sorted(glob.glob(os.path.join(here, "*.lspy")))
+    if not lispys:
+        sys.exit(__doc__)
+
+    print("%-16s %-20s %9s %10s %14s" % ("script", "lispy", "best s", "rss KB", "cache misses"))
+    for script in scripts:
+        for lispy in lispys:
+            cmd = [lispy, script]
+            results = [run(cmd) for _ in range(RUNS)]
+            best = min(t for t, _ in results)
+            rss = max(r for _, r in results)
+            print("%-16s %-20s %9.3f %10d %14s" % (
+                os.path.basename(script), os.path.basename(lispy), best, rss,
+                misses(cmd) or "n/a"))
+
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
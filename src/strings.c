@@ -1,13 +1,44 @@
 //#include <stdio.h>
 //#include <stdlib.h>
 
+/* building with LISPY_JIT on x86-64 Linux compiles hot numeric lambdas
+   to machine code */
+#if defined(LISPY_JIT) && defined(__x86_64__) && defined(__linux__)
+#define LJIT
+#define _DEFAULT_SOURCE
+#include <sys/mman.h>
+#endif
+
 #include "mpc.h"
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/resource.h>
+
+/* building with LISPY_NO_EDITLINE reads plain lines from stdin instead */
+#ifdef LISPY_NO_EDITLINE
+char lispy_line[2048];
+
+char* readline(char* prompt) {
+    fputs(prompt, stdout);
+    fflush(stdout);
+    if (fgets(lispy_line, sizeof(lispy_line), stdin) == NULL) { return NULL; }
+    lispy_line[strcspn(lispy_line, "\n")] = '\0';
+
+    char* cpy = malloc(strlen(lispy_line) + 1);
+    strcpy(cpy, lispy_line);
+    return cpy;
+}
+
+void add_history(char* unused) {}
+#else
 #include <editline/readline.h>
 
 #ifndef __APPLE__
 /* not needed for osx */
 #include <editline/history.h>
 #endif
+#endif
 
 mpc_parser_t* Number;
 mpc_parser_t* Symbol;
@@ -21,8 +52,12 @@ mpc_parser_t* Lispy;
 
 struct lval;
 struct lenv;
+struct lcode;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct lbdesc lbdesc;
+typedef struct ljit ljit;
 
 
 /* create enum for possible lval types */
@@ -36,35 +71,416 @@ enum {
     LVAL_QEXPR
 };
 
-typedef lval*(*lbuiltin)(lenv*, lval*);
+/* an argument of any type, for builtin descriptors */
+#define LVAL_ANY -1
 
-struct lval {
-    int type;
-    long num;
-    char* err;
-    char* sym;
-    char* str;
+/* builtins borrow their arguments from the evaluator's argument buffer */
+typedef lval*(*lfunc)(lenv*, lval**, int);
+
+/* what the evaluator knows about a builtin. Arguments are checked against
+   the arity and types before func runs, an argument past the last type
+   given takes the last one. op lets the evaluator recognise a builtin
+   without comparing names. A pure builtin runs no code and references
+   whatever of its arguments it keeps, so they can be borrowed straight
+   from where they are bound */
+enum {
+    LB_LAMBDA, LB_DEF, LB_PUT,
+    LB_LIST, LB_HEAD, LB_TAIL, LB_EVAL, LB_JOIN,
+    LB_ADD, LB_SUB, LB_MUL, LB_DIV,
+    LB_IF, LB_EQ, LB_NE, LB_GT, LB_LT, LB_GE, LB_LE,
+    LB_LOAD, LB_ERROR, LB_PRINT,
+    LB_POOL_STATS, LB_GC, LB_GC_STATS, LB_GC_MAX_PAUSE, LB_GC_BUDGET,
+    LB_MAX_DEPTH, LB_MAX_NEST, LB_OPTIMIZE, LB_HASH_CONS
+};
+
+#define LB_TYPES 3
+#define LB_PURE 1
+
+struct lbdesc {
+    char* name;
+    lfunc func;
+    int op;
+    int pure;
+    int min, max;
+    int ntypes;
+    int types[LB_TYPES];
+};
+
+/* Memory Pool */
+
+/* size classes are multiples of LPOOL_ALIGN, each with its own free list.
+   Free nodes have their first byte set to LPOOL_FREE so the collector can
+   walk the slabs, which is why the free list link lives in the second word */
+#define LPOOL_ALIGN 8
+#define LPOOL_CLASSES 16
+#define LPOOL_SLAB 16384
+#define LPOOL_FREE 0xFF
+
+#define LPOOL_LINK(x) (*(void**)((char*)(x) + sizeof(void*)))
+
+typedef struct lpool {
+    void* free;
+    char* slabs;
+    long hits;
+    long misses;
+} lpool;
+
+/* lval and lenv nodes are kept apart so the slabs of lval_pools hold
+   nothing but values */
+lpool lval_pools[LPOOL_CLASSES];
+lpool lenv_pools[LPOOL_CLASSES];
+long lpool_slabs;
+
+int lpool_class(size_t size) {
+    return (size + LPOOL_ALIGN - 1) / LPOOL_ALIGN - 1;
+}
+
+/* building with LISPY_MALLOC bypasses the pools and the nursery to compare
+   against plain malloc, the collector then has no slabs to sweep */
+void lpool_free(lpool* pools, void* x, size_t size) {
+#ifdef LISPY_MALLOC
+    free(x);
+    return;
+#endif
+    int c = lpool_class(size);
+    if (c >= LPOOL_CLASSES) { free(x); return; }
+
+    *(unsigned char*)x = LPOOL_FREE;
+    LPOOL_LINK(x) = pools[c].free;
+    pools[c].free = x;
+}
+
+void* lpool_alloc(lpool* pools, size_t size) {
+#ifdef LISPY_MALLOC
+    return malloc(size);
+#endif
+    int c = lpool_class(size);
+    if (c >= LPOOL_CLASSES) { return malloc(size); }
+
+    lpool* p = &pools[c];
+    if (p->free) {
+        void* x = p->free;
+        p->free = LPOOL_LINK(x);
+        p->hits++;
+        return x;
+    }
+
+    /* out of nodes, carve a fresh slab into the free list */
+    p->misses++;
+    lpool_slabs++;
+    size_t sz = (c + 1) * LPOOL_ALIGN;
+    char* slab = malloc(LPOOL_SLAB);
+    *(char**)slab = p->slabs;
+    p->slabs = slab;
+
+    char* x = slab + LPOOL_ALIGN;
+    for (char* n = x + sz; n + sz <= slab + LPOOL_SLAB; n += sz) {
+        lpool_free(pools, n, sz);
+    }
+    return x;
+}
+
+/* Young Generation */
+
+/* new values are bump allocated from the nursery while a top-level form is
+   evaluated. Every chunk counts the nodes still alive in it and is reused
+   as soon as they have all died, which for the temporaries of a call is
+   almost straight away. Values that outlive the form by being stored into
+   the heap (def or = on an environment outside the nursery) are promoted
+   by the write barrier in lval_keep. If survivors pin all LARENA_CHUNKS
+   chunks, new values come from the pools until one of them empties */
+#define LARENA_CHUNK 65536
+#define LARENA_CHUNKS 64
+
+typedef struct lchunk {
+    struct lchunk* next;
+    struct lchunk* empty;
+    char* raw;
+    long live;
+} lchunk;
+
+typedef struct larena {
+    int on;
+    int count;
+    lchunk* chunks;
+    lchunk* empty;
+    lchunk* chunk;
+    char* top;
+} larena;
+
+larena arena;
+
+/* chunks are aligned to their size so a node can find its own chunk */
+#define LARENA_START(c) ((char*)(c) + sizeof(lchunk))
+#define LARENA_CHUNK_OF(x) \
+    ((lchunk*)((uintptr_t)(x) & ~(uintptr_t)(LARENA_CHUNK - 1)))
+
+lchunk* larena_chunk(void) {
+    if (arena.empty) {
+        lchunk* c = arena.empty;
+        arena.empty = c->empty;
+        return c;
+    }
+    if (arena.count == LARENA_CHUNKS) { return NULL; }
+
+    char* raw = malloc(LARENA_CHUNK * 2);
+    lchunk* c = LARENA_CHUNK_OF(raw + LARENA_CHUNK - 1);
+    c->raw = raw;
+    c->live = 0;
+    c->next = arena.chunks;
+    arena.chunks = c;
+    arena.count++;
+    return c;
+}
+
+void* larena_alloc(size_t size) {
+#ifdef LISPY_MALLOC
+    return NULL;
+#endif
+    size = (size + LPOOL_ALIGN - 1) & ~(LPOOL_ALIGN - 1);
+
+    if (arena.chunk == NULL || arena.top + size > (char*)arena.chunk + LARENA_CHUNK) {
+        lchunk* c = larena_chunk();
+        if (c == NULL) { return NULL; }
+        arena.chunk = c;
+        arena.top = LARENA_START(c);
+    }
+
+    void* x = arena.top;
+    arena.top += size;
+    arena.chunk->live++;
+    return x;
+}
+
+void larena_free(void* x) {
+    lchunk* c = LARENA_CHUNK_OF(x);
+    if (--c->live > 0) { return; }
+
+    if (c == arena.chunk) {
+        arena.top = LARENA_START(c);
+    } else {
+        c->empty = arena.empty;
+        arena.empty = c;
+    }
+}
+
+/* nested forms (load inside a form) stay in the outer region */
+int larena_begin(void) {
+    if (arena.on) { return 0; }
+    arena.on = 1;
+    return 1;
+}
+
+void larena_end(int region) {
+    if (region) { arena.on = 0; }
+}
+
+void lpool_release(lpool* pools) {
+    for (int c = 0; c < LPOOL_CLASSES; c++) {
+        while (pools[c].slabs) {
+            char* next = *(char**)pools[c].slabs;
+            free(pools[c].slabs);
+            pools[c].slabs = next;
+        }
+        pools[c].free = NULL;
+    }
+}
+
+void lpool_cleanup(void) {
+    lpool_release(lval_pools);
+    lpool_release(lenv_pools);
+
+    while (arena.chunks) {
+        lchunk* next = arena.chunks->next;
+        free(arena.chunks->raw);
+        arena.chunks = next;
+    }
+}
+
+/* Symbol Table */
+
+/* every symbol name is stored once, so symbols compare by pointer and
+   carry a small integer id. binds counts the environments holding the
+   name, while it is one and that is the global scope the value is cached */
+typedef struct lsym {
+    char* name;
+    unsigned long hash;
+    int id;
+    int binds;
+    struct lval* global;
+} lsym;
+
+typedef struct {
+    lsym** slots;
+    int size;
+    int count;
+} lsymtab;
+
+#define LSYM_SLOTS 256
+
+lsymtab symtab;
+lsym* lsym_amp;
+lsym* lsym_if;
+
+unsigned long lsym_hash(char* s) {
+    unsigned long h = 2166136261u;
+    while (*s) { h = (h ^ (unsigned char)*s++) * 16777619u; }
+    return h;
+}
+
+void lsym_grow(void) {
+    int size = symtab.size ? symtab.size * 2 : LSYM_SLOTS;
+    lsym** slots = calloc(size, sizeof(lsym*));
+    for (int i = 0; i < symtab.size; i++) {
+        lsym* y = symtab.slots[i];
+        if (!y) { continue; }
+        int j = y->hash & (size - 1);
+        while (slots[j]) { j = (j + 1) & (size - 1); }
+        slots[j] = y;
+    }
+    free(symtab.slots);
+    symtab.slots = slots;
+    symtab.size = size;
+}
+
+lsym* lsym_intern(char* s) {
+    if (symtab.count * 2 >= symtab.size) { lsym_grow(); }
+
+    unsigned long h = lsym_hash(s);
+    int i = h & (symtab.size - 1);
+    while (symtab.slots[i]) {
+        lsym* y = symtab.slots[i];
+        if (y->hash == h && strcmp(y->name, s) == 0) { return y; }
+        i = (i + 1) & (symtab.size - 1);
+    }
+
+    lsym* y = malloc(sizeof(lsym));
+    y->name = malloc(strlen(s) + 1);
+    strcpy(y->name, s);
+    y->hash = h;
+    y->id = symtab.count++;
+    y->binds = 0;
+    y->global = NULL;
+    symtab.slots[i] = y;
+    return y;
+}
+
+void lsym_bind(lsym* y, int n) {
+    y->binds += n;
+    y->global = NULL;
+}
+
+void lsym_cleanup(void) {
+    for (int i = 0; i < symtab.size; i++) {
+        if (!symtab.slots[i]) { continue; }
+        free(symtab.slots[i]->name);
+        free(symtab.slots[i]);
+    }
+    free(symtab.slots);
+    symtab.slots = NULL;
+    symtab.size = symtab.count = 0;
+}
 
-    lbuiltin builtin;
+/* what a lambda holds, args are the arguments a partial application
+   was given */
+typedef struct lfun {
     lenv* env;
     lval* formals;
     lval* body;
+    lcode* code;
+    lval* args;
+} lfun;
 
-    int count;
-    lval** cell;
+/* the type, allocation flag and reference count share one word, the
+   payload is a union of the small members. Only lambdas, whose builtin
+   is NULL, are allocated with room for the lfun at the end */
+struct lval {
+    unsigned char type;
+    unsigned char arena;
+    unsigned char color;
+    int rc;
+
+    union {
+        long num;
+        char* err;
+        struct {
+            lsym* sym;
+            int slot;
+        };
+        char* str;
+        const lbdesc* builtin;
+
+        /* hash caches lval_hash in the padding after count, zero until
+           it is asked for */
+        struct {
+            int count;
+            unsigned hash;
+            lval** cell;
+        };
+    };
+
+    lfun fun[];
 };
 
+/* small integers are stored in the pointer itself with the low bit set,
+   only numbers that do not fit in the remaining bits are boxed */
+#define LVAL_INT_MIN (LONG_MIN / 2)
+#define LVAL_INT_MAX (LONG_MAX / 2)
+
+#define LVAL_IS_INT(v) ((uintptr_t)(v) & 1)
+#define LVAL_INT(x) ((lval*)(((uintptr_t)(x) << 1) | 1))
+
+#define LTYPE(v) (LVAL_IS_INT(v) ? LVAL_NUM : (v)->type)
+#define LNUM(v) (LVAL_IS_INT(v) ? (long)((intptr_t)(v) >> 1) : (v)->num)
+
+#define LVAL_LAMBDA_SIZE (sizeof(lval) + sizeof(lfun))
+
+size_t lval_size(lval* v) {
+    return v->type == LVAL_FUN && !v->builtin ? LVAL_LAMBDA_SIZE : sizeof(lval);
+}
+
+/* every lval made, from the arena or the pools */
+long lval_allocs;
+
+/* set by the collector, the color new nodes get and whether stores have
+   to shade what they store, see Garbage Collector */
+unsigned char lval_color;
+int lgc_marking;
+void lgc_shade(lval* v);
+
+lval* lval_alloc(int type, size_t size) {
+    lval_allocs++;
+    lval* v = arena.on ? larena_alloc(size) : NULL;
+    if (v) {
+        v->arena = 1;
+    } else {
+        v = lpool_alloc(lval_pools, size);
+        v->arena = 0;
+    }
+    v->type = type;
+    v->color = lval_color;
+    v->rc = 1;
+    return v;
+}
+
+void lval_free(lval* v) {
+    if (v->arena) {
+        larena_free(v);
+    } else {
+        lpool_free(lval_pools, v, lval_size(v));
+    }
+}
 
 lval* lval_num(long x) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_NUM;
+    if (x >= LVAL_INT_MIN && x <= LVAL_INT_MAX) { return LVAL_INT(x); }
+
+    lval* v = lval_alloc(LVAL_NUM, sizeof(lval));
     v->num = x;
     return v;
 }
 
 lval* lval_err(char* fmt, ...) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
+    lval* v = lval_alloc(LVAL_ERR, sizeof(lval));
     
     va_list va;
     va_start(va, fmt);
@@ -79,91 +495,137 @@ lval* lval_err(char* fmt, ...) {
 }
 
 lval* lval_sym(char * s) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
+    lval* v = lval_alloc(LVAL_SYM, sizeof(lval));
+    v->sym = lsym_intern(s);
+    v->slot = -1;
     return v;
 }
 
 lval* lval_str(char* s) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_STR;
+    lval* v = lval_alloc(LVAL_STR, sizeof(lval));
     v->str = malloc(strlen(s) + 1);
     strcpy(v->str, s);
     return v;
 }
 
-lval* lval_builtin(lbuiltin func) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
-    v->builtin = func;
+lval* lval_builtin(const lbdesc* d) {
+    lval* v = lval_alloc(LVAL_FUN, sizeof(lval));
+    v->builtin = d;
     return v;
 }
 
 lenv* lenv_new(void);
 
 lval* lval_lambda(lval* formals, lval* body) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
+    lval* v = lval_alloc(LVAL_FUN, LVAL_LAMBDA_SIZE);
     v->builtin = NULL;
-    v->env = lenv_new();
-    v->formals = formals;
-    v->body = body;
+    v->fun->env = lenv_new();
+    v->fun->formals = formals;
+    v->fun->body = body;
+    v->fun->code = NULL;
+    v->fun->args = NULL;
     return v;
 }
 
 lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SEXPR;
+    lval* v = lval_alloc(LVAL_SEXPR, sizeof(lval));
     v->count = 0;
+    v->hash = 0;
     v->cell = NULL;
     return v;
 }
 
 lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_QEXPR;
+    lval* v = lval_alloc(LVAL_QEXPR, sizeof(lval));
     v->count = 0;
+    v->hash = 0;
     v->cell = NULL;
     return v;
 }
 
 void lenv_del(lenv* e);
+void lcode_del(lcode* c);
+
+lval* lval_ref(lval* v) {
+    if (!LVAL_IS_INT(v)) { v->rc++; }
+    return v;
+}
+
+/* the walkers over nested values keep the nodes still to visit on a heap
+   stack instead of recursing, so only memory bounds how deep a value is */
+typedef struct lstack {
+    lval** items;
+    int count;
+    int max;
+} lstack;
 
+void lstack_push(lstack* s, lval* v) {
+    if (s->count == s->max) {
+        s->max = s->max ? s->max * 2 : 64;
+        s->items = realloc(s->items, sizeof(lval*) * s->max);
+    }
+    s->items[s->count++] = v;
+}
+
+lval* lstack_pop(lstack* s) {
+    return s->count ? s->items[--s->count] : NULL;
+}
+
+/* nodes whose last reference has gone, freed by the outermost lval_del */
+lstack ldead;
+int ldead_busy;
+
+/* drops one reference, the value is freed when the last one goes */
 void lval_del(lval* v) {
+    if (LVAL_IS_INT(v)) { return; }
+    if (--v->rc > 0) { return; }
 
-    switch(v->type) {
-        case LVAL_NUM: break;
-        case LVAL_FUN:
-            if (!v->builtin) {
-                lenv_del(v->env);
-                lval_del(v->formals);
-                lval_del(v->body);
-            }
-            break;
-        case LVAL_ERR: free(v->err); break;
-        case LVAL_SYM: free(v->sym); break;
-        case LVAL_STR: free(v->str); break; 
-        /*if Sexpr then delete all elements inside */
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-            for (int i = 0; i < v->count ; i++) {
-                lval_del(v->cell[i]);
-            }
-            /* free memory allocated with pointers */
-            free(v->cell);
-            break;
+    if (ldead_busy) {
+        lstack_push(&ldead, v);
+        return;
+    }
+
+    ldead_busy = 1;
+    for (; v; v = lstack_pop(&ldead)) {
+        switch(v->type) {
+            case LVAL_NUM: break;
+            case LVAL_FUN:
+                if (!v->builtin) {
+                    lenv_del(v->fun->env);
+                    lval_del(v->fun->formals);
+                    lval_del(v->fun->body);
+                    lcode_del(v->fun->code);
+                    if (v->fun->args) { lval_del(v->fun->args); }
+                }
+                break;
+            case LVAL_ERR: free(v->err); break;
+            case LVAL_STR: free(v->str); break; 
+            /*if Sexpr then delete all elements inside */
+            case LVAL_QEXPR:
+            case LVAL_SEXPR:
+                for (int i = 0; i < v->count ; i++) {
+                    lval_del(v->cell[i]);
+                }
+                /* free memory allocated with pointers */
+                free(v->cell);
+                break;
+        }
+        lval_free(v);
     }
-    free(v);
+    ldead_busy = 0;
 }
 
-lenv* lenv_copy(lenv* e);
+lenv* lenv_ref(lenv* e);
+lenv* lenv_keep(int arena, lenv* e);
+lcode* lcode_ref(lcode* c);
+lcode* lcode_new(lenv* e, lval* formals, lval* body);
+lcode* lcode_moved(lcode* c, lval* formals, lval* body);
 
-lval* lval_copy(lval* v) {
+/* copies a single node, the children are shared with the original */
+lval* lval_clone(lval* v) {
+    if (LVAL_IS_INT(v)) { return v; }
 
-    lval* x = malloc(sizeof(lval));
-    x->type = v->type;
+    lval* x = lval_alloc(v->type, lval_size(v));
 
     switch(v->type) {
 
@@ -172,20 +634,24 @@ lval* lval_copy(lval* v) {
                 x->builtin = v->builtin;
             } else {
                 x->builtin = NULL;
-                x->env = lenv_copy(v->env);
-                x->formals = lval_copy(v->formals);
-                x->body = lval_copy(v->body);
+                x->fun->env = lenv_ref(v->fun->env);
+                x->fun->formals = lval_ref(v->fun->formals);
+                x->fun->body = lval_ref(v->fun->body);
+                x->fun->code = lcode_ref(v->fun->code);
+                x->fun->args = v->fun->args ? lval_ref(v->fun->args) : NULL;
             }
             break;
         case LVAL_NUM: x->num = v->num; break;
         case LVAL_ERR: x->err = malloc(strlen(v->err) + 1); strcpy(x->err, v->err); break;
-        case LVAL_SYM: x->sym = malloc(strlen(v->sym) + 1); strcpy(x->sym, v->sym); break;
+        case LVAL_SYM: x->sym = v->sym; x->slot = v->slot; break;
+        case LVAL_STR: x->str = malloc(strlen(v->str) + 1); strcpy(x->str, v->str); break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
             x->count = v->count;
+            x->hash = v->hash;
             x->cell = malloc(sizeof(lval*) * x->count);
             for (int i = 0; i < x->count; i++) {
-                x->cell[i] = lval_copy(v->cell[i]);
+                x->cell[i] = lval_ref(v->cell[i]);
             }
             break;
     }
@@ -193,19 +659,105 @@ lval* lval_copy(lval* v) {
     return x;
 }
 
+/* a child still in the nursery is replaced by a heap clone, whose own
+   children are left on s for lval_adopt to look at */
+lval* lval_adopt_child(lstack* s, lval* v) {
+    if (LVAL_IS_INT(v) || !v->arena) { return v; }
+    lval* x = lval_clone(v);
+    lval_del(v);
+    lstack_push(s, x);
+    return x;
+}
+
+/* moves everything the heap node x reaches in the nursery out with it */
+void lval_adopt(lval* x) {
+    lstack s = { NULL, 0, 0 };
+    lstack funs = { NULL, 0, 0 };
+    int on = arena.on;
+    arena.on = 0;
+
+    for (; x; x = lstack_pop(&s)) {
+        if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+            for (int i = 0; i < x->count; i++) {
+                x->cell[i] = lval_adopt_child(&s, x->cell[i]);
+            }
+        } else if (x->type == LVAL_FUN && !x->builtin) {
+            lenv* env = lenv_keep(0, x->fun->env);
+            lenv_del(x->fun->env);
+            x->fun->env = env;
+            lval* body = x->fun->body;
+            x->fun->formals = lval_adopt_child(&s, x->fun->formals);
+            x->fun->body = lval_adopt_child(&s, x->fun->body);
+            if (x->fun->args) { x->fun->args = lval_adopt_child(&s, x->fun->args); }
+            if (x->fun->body != body && x->fun->code) { lstack_push(&funs, x); }
+        }
+    }
+
+    /* the code points into the body, a promoted body needs its own */
+    while ((x = lstack_pop(&funs))) {
+        x->fun->code = lcode_moved(x->fun->code, x->fun->formals, x->fun->body);
+    }
+
+    arena.on = on;
+    free(s.items);
+    free(funs.items);
+}
+
+/* a copy in the heap may not point into the nursery, see lval_keep */
+lval* lval_copy(lval* v) {
+    lval* x = lval_clone(v);
+    if (!LVAL_IS_INT(x) && !x->arena) { lval_adopt(x); }
+    return x;
+}
+
+/* values are shared until someone needs to change one, so anything about
+   to be mutated goes through here first to get a private node */
+lval* lval_unshare(lval* v) {
+    if (LVAL_IS_INT(v) || v->rc == 1) { return v; }
+    lval* x = lval_copy(v);
+    lval_del(v);
+    return x;
+}
+
+/* copy a value out of the arena so it outlives the current form, heap
+   nodes never point into the arena so they are returned as they are */
+lval* lval_promote(lval* v) {
+    if (LVAL_IS_INT(v) || !v->arena) { return v; }
+
+    int on = arena.on;
+    arena.on = 0;
+    lval* x = lval_copy(v);
+    arena.on = on;
+
+    lval_del(v);
+    return x;
+}
+
+/* write barrier for storing x under a parent, an old parent may not point
+   into the nursery so x is promoted unless the parent is young as well.
+   While the collector marks, x is shaded for it */
+lval* lval_keep(int arena, lval* x) {
+    if (arena) { return x; }
+    x = lval_promote(x);
+    if (lgc_marking) { lgc_shade(x); }
+    return x;
+}
+
 lval* lval_add(lval* v, lval* x) {
+    v = lval_unshare(v);
+    x = lval_keep(v->arena, x);
     v->count++;
     v->cell = realloc(v->cell, sizeof(lval*) * v->count);
     v->cell[v->count-1] = x;
+    v->hash = 0;
     return v;
 }
 
 lval* lval_join(lval* x, lval* y) {
     for (int i = 0; i < y->count; i++) {
-        x = lval_add(x, y->cell[i]);
+        x = lval_add(x, lval_ref(y->cell[i]));
     }
-    free(y->cell);
-    free(y);
+    lval_del(y);
     return x;
 }
 
@@ -214,26 +766,32 @@ lval* lval_pop(lval* v, int i) {
     memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
     v->count--;
     v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+    v->hash = 0;
     return x;
 }
 
 lval* lval_take(lval* v, int i) {
-    lval *x = lval_pop(v, i);
+    lval *x = lval_ref(v->cell[i]);
     lval_del(v);
     return x;
 }
 
-void lval_print(lval *v);
+/* the formals of f that have an argument already */
+int lval_bound(lval* f) {
+    return f->fun->args ? f->fun->args->count : 0;
+}
+
+/* punctuation lval_print still has to write is pushed as one of these */
+lval lval_punct[] = { { .num = ' ' }, { .num = ')' }, { .num = '}' } };
 
-void lval_print_expr(lval* v, char open, char close) {
+/* the elements from the first on */
+void lval_print_expr(lstack* s, lval* v, int first, char open, lval* close) {
     putchar(open);
-    for (int i = 0; i < v->count; i++) {
-        lval_print(v->cell[i]);
-        if (i != (v->count-1)) {
-            putchar(' ');
-        }
+    lstack_push(s, close);
+    for (int i = v->count - 1; i >= first; i--) {
+        lstack_push(s, v->cell[i]);
+        if (i != first) { lstack_push(s, &lval_punct[0]); }
     }
-    putchar(close);
 }
 
 void lval_print_str(lval* v) {
@@ -245,24 +803,37 @@ void lval_print_str(lval* v) {
 }
 
 void lval_print(lval* v) {
-    switch(v->type) {
-        case LVAL_FUN:
-           if (v->builtin) {
-              printf("<builtin>");
-           } else {
-              printf("(\\ ");
-              lval_print(v->formals);
-              putchar(' ');
-              lval_print(v->body);
-              putchar(')');
-           } 
-        case LVAL_NUM: printf("%li", v->num); break;
-        case LVAL_ERR: printf("Error: %s", v->err); break;
-        case LVAL_SYM: printf("%s", v->sym); break;
-        case LVAL_STR: lval_print_str(v); break;
-        case LVAL_SEXPR: lval_print_expr(v, '(',')'); break;
-        case LVAL_QEXPR: lval_print_expr(v, '{','}'); break;
+    lstack s = { NULL, 0, 0 };
+
+    for (; v; v = lstack_pop(&s)) {
+        if (v == &lval_punct[0] || v == &lval_punct[1] || v == &lval_punct[2]) {
+            putchar(v->num);
+            continue;
+        }
+
+        switch(LTYPE(v)) {
+            case LVAL_FUN:
+               if (v->builtin) {
+                  printf("<builtin>");
+               } else {
+                  /* a partial application shows the formals it still takes */
+                  printf("(\\ ");
+                  lstack_push(&s, &lval_punct[1]);
+                  lstack_push(&s, v->fun->body);
+                  lstack_push(&s, &lval_punct[0]);
+                  lval_print_expr(&s, v->fun->formals, lval_bound(v), '{',
+                                  &lval_punct[2]);
+               } 
+               break;
+            case LVAL_NUM: printf("%li", LNUM(v)); break;
+            case LVAL_ERR: printf("Error: %s", v->err); break;
+            case LVAL_SYM: printf("%s", v->sym->name); break;
+            case LVAL_STR: lval_print_str(v); break;
+            case LVAL_SEXPR: lval_print_expr(&s, v, 0, '(', &lval_punct[1]); break;
+            case LVAL_QEXPR: lval_print_expr(&s, v, 0, '{', &lval_punct[2]); break;
+        }
     }
+    free(s.items);
 }
 
 void lval_println(lval* v) { 
@@ -270,31 +841,218 @@ void lval_println(lval* v) {
     putchar('\n');
 }
 
-int lval_eq(lval* x, lval* y) {
-    if (x->type != y->type) { return 0; }
+/* Hashing */
 
-    switch (x->type) {
-        case LVAL_NUM: return (x->num == y->num);
-        case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
-        case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-        case LVAL_STR: return (strcmp(x->str, y->str) == 0);
-        case LVAL_FUN:
-            if (x->builtin || y->builtin) {
-                return x->builtin == y->builtin;
-            } else {
-                return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
-            }
-        case LVAL_QEXPR:
+/* lval_hash is structural, values lval_eq finds equal hash the same, and
+   it only depends on the value so it is the same from run to run. Lists
+   cache theirs until they are changed, the others are cheap to hash */
+unsigned long lval_mix(unsigned long h, unsigned long x) {
+    return (h ^ x) * 16777619u + (h >> 29);
+}
+
+/* whether v can be hashed without looking at a list not hashed yet */
+int lval_hashed(lval* v) {
+    if (LVAL_IS_INT(v)) { return 1; }
+    switch (v->type) {
         case LVAL_SEXPR:
-            if (x->count != y->count) { return 0; }
-            for (int i = 0; i < x->count; i++) {
-                if (!lval_eq(x->cell[i], y->cell[i]))
-                    return 0;
+        case LVAL_QEXPR: return v->hash != 0;
+        case LVAL_FUN: return v->builtin || v->fun->body->hash != 0;
+    }
+    return 1;
+}
+
+/* the hash of v once everything below it is hashed */
+unsigned long lval_hash_node(lval* v) {
+    if (LVAL_IS_INT(v)) { return lval_mix(LVAL_NUM, LNUM(v)); }
+
+    unsigned long h = v->type;
+    switch (v->type) {
+        case LVAL_NUM: return lval_mix(h, v->num);
+        case LVAL_ERR: return lval_mix(h, lsym_hash(v->err));
+        case LVAL_SYM: return lval_mix(h, v->sym->hash);
+        case LVAL_STR: return lval_mix(h, lsym_hash(v->str));
+        case LVAL_FUN:
+            if (v->builtin) { return lval_mix(h, v->builtin->op); }
+            /* as lval_eq, the formals already given are left out */
+            h = lval_mix(h, v->fun->formals->count - lval_bound(v));
+            for (int i = lval_bound(v); i < v->fun->formals->count; i++) {
+                h = lval_mix(h, lval_hash_node(v->fun->formals->cell[i]));
             }
-            return 1;
-        break;
+            return lval_mix(h, v->fun->body->hash);
     }
-    return 0;
+
+    if (v->hash) { return v->hash; }
+    h = lval_mix(h, v->count);
+    for (int i = 0; i < v->count; i++) {
+        h = lval_mix(h, lval_hash_node(v->cell[i]));
+    }
+    /* the cache keeps the low half, which is the hash of a list */
+    v->hash = (unsigned)h ? (unsigned)h : 1;
+    return v->hash;
+}
+
+/* lists are hashed children first from a stack, a list goes back under
+   the children it still waits for */
+unsigned long lval_hash(lval* v) {
+    lstack s = { NULL, 0, 0 };
+    for (lval* x = v; x; x = lstack_pop(&s)) {
+        if (lval_hashed(x)) { continue; }
+        lval* l = x->type == LVAL_FUN ? x->fun->body : x;
+        int waits = 0;
+        for (int i = 0; i < l->count; i++) {
+            if (lval_hashed(l->cell[i])) { continue; }
+            if (!waits++) { lstack_push(&s, x); }
+            lstack_push(&s, l->cell[i]);
+        }
+        if (!waits) { lval_hash_node(l); }
+    }
+    free(s.items);
+    return lval_hash_node(v);
+}
+
+/* the pairs still to compare are kept on a stack, each x below its y. A
+   value is equal to itself, and lists whose hashes are both known and
+   differ are not equal */
+int lval_eq(lval* x, lval* y) {
+    if (x == y) { return 1; }
+    /* a boxed number never equals a small one */
+    if (LVAL_IS_INT(x) || LVAL_IS_INT(y)) { return 0; }
+
+    lstack s = { NULL, 0, 0 };
+    int eq = 1;
+
+    do {
+        if (x == y) { continue; }
+        if (LTYPE(x) != LTYPE(y)) { eq = 0; break; }
+
+        switch (LTYPE(x)) {
+            case LVAL_NUM: eq = LNUM(x) == LNUM(y); break;
+            case LVAL_ERR: eq = strcmp(x->err, y->err) == 0; break;
+            case LVAL_SYM: eq = x->sym == y->sym; break;
+            case LVAL_STR: eq = strcmp(x->str, y->str) == 0; break;
+            case LVAL_FUN:
+                if (x->builtin || y->builtin) {
+                    eq = x->builtin && y->builtin
+                        && x->builtin->func == y->builtin->func;
+                } else {
+                    int i = lval_bound(x);
+                    int j = lval_bound(y);
+                    if (x->fun->formals->count - i != y->fun->formals->count - j) {
+                        eq = 0;
+                        break;
+                    }
+                    lstack_push(&s, x->fun->body);
+                    lstack_push(&s, y->fun->body);
+                    for (; i < x->fun->formals->count; i++, j++) {
+                        lstack_push(&s, x->fun->formals->cell[i]);
+                        lstack_push(&s, y->fun->formals->cell[j]);
+                    }
+                }
+                break;
+            case LVAL_QEXPR:
+            case LVAL_SEXPR:
+                if (x->count != y->count
+                        || (x->hash && y->hash && x->hash != y->hash)) {
+                    eq = 0;
+                    break;
+                }
+                for (int i = x->count - 1; i >= 0; i--) {
+                    lstack_push(&s, x->cell[i]);
+                    lstack_push(&s, y->cell[i]);
+                }
+                break;
+        }
+    } while (eq && (y = lstack_pop(&s)) && (x = lstack_pop(&s)));
+
+    free(s.items);
+    return eq;
+}
+
+/* with hash consing on, each Q-expression literal read is looked up in
+   a table of the ones read before and an equal one is shared instead.
+   (hash-cons 1) applies to what is read after it, load reads each form
+   of a file just before running it. The table holds a reference to each
+   with its hash, nothing changes a shared value in place, and the ones
+   nobody else holds are dropped when it fills up */
+typedef struct {
+    lval* v;
+    unsigned long hash;
+} lconsent;
+
+typedef struct {
+    lconsent* slots;
+    int size;
+    int count;
+} lconstab;
+
+#define LCONS_SLOTS 256
+
+lconstab constab;
+int lcons_on;
+
+void lcons_grow(void) {
+    int live = 0;
+    for (int i = 0; i < constab.size; i++) {
+        lval* v = constab.slots[i].v;
+        if (v && v->rc == 1) {
+            lval_del(v);
+            constab.slots[i].v = NULL;
+        } else if (v) {
+            live++;
+        }
+    }
+
+    int size = constab.size ? constab.size : LCONS_SLOTS;
+    while (live * 2 >= size) { size *= 2; }
+    lconsent* slots = calloc(size, sizeof(lconsent));
+    for (int i = 0; i < constab.size; i++) {
+        if (!constab.slots[i].v) { continue; }
+        int j = constab.slots[i].hash & (size - 1);
+        while (slots[j].v) { j = (j + 1) & (size - 1); }
+        slots[j] = constab.slots[i];
+    }
+    free(constab.slots);
+    constab.slots = slots;
+    constab.size = size;
+    constab.count = live;
+}
+
+/* the shared literal equal to v, which is taken */
+lval* lval_cons(lval* v) {
+    if (constab.count * 2 >= constab.size) { lcons_grow(); }
+
+    unsigned long h = lval_hash(v);
+    int i = h & (constab.size - 1);
+    while (constab.slots[i].v) {
+        lval* x = constab.slots[i].v;
+        if (constab.slots[i].hash == h && lval_eq(x, v)) {
+            lval_del(v);
+            return lval_ref(x);
+        }
+        i = (i + 1) & (constab.size - 1);
+    }
+
+    v = lval_promote(v);
+    if (lgc_marking) { lgc_shade(v); }
+    constab.slots[i].v = lval_ref(v);
+    constab.slots[i].hash = h;
+    constab.count++;
+    return v;
+}
+
+void lcons_cleanup(void) {
+    for (int i = 0; i < constab.size; i++) {
+        if (constab.slots[i].v) { lval_del(constab.slots[i].v); }
+    }
+    free(constab.slots);
+    constab.slots = NULL;
+    constab.size = constab.count = 0;
+}
+
+lval* builtin_hash_cons(lenv* e, lval** argv, int argc) {
+    long old = lcons_on;
+    lcons_on = LNUM(argv[0]) != 0;
+    return lval_num(old);
 }
 
 char* ltype_name(int t) {
@@ -312,318 +1070,745 @@ char* ltype_name(int t) {
 
 /* Lisp Environment */
 
+#define LENV_INLINE 3
+
 struct lenv {
     lenv* par;
-    int count;
-    char** syms;
+    lsym** syms;
     lval** vals;
+    int* index;
+    int size;
+    int count;
+    int rc;
+    unsigned char arena;
+
+    /* small frames keep their bindings inline */
+    lsym* isyms[LENV_INLINE];
+    lval* ivals[LENV_INLINE];
 };
 
+/* small frames are scanned, larger ones get an open addressing index
+   of binding positions keyed by the symbol hash, kept at most half full */
+#define LENV_INDEX 8
+
+void lenv_index(lenv* e) {
+    int size = e->size ? e->size : LENV_INDEX * 4;
+    while (size < e->count * 2) { size *= 2; }
+    free(e->index);
+    e->index = malloc(sizeof(int) * size);
+    e->size = size;
+    for (int i = 0; i < size; i++) { e->index[i] = -1; }
+    for (int i = 0; i < e->count; i++) {
+        int j = e->syms[i]->hash & (size - 1);
+        while (e->index[j] != -1) { j = (j + 1) & (size - 1); }
+        e->index[j] = i;
+    }
+}
+
+/* indexes the bindings from first on, rebuilding the index at twice the
+   size instead once they would fill more than half of it */
+void lenv_reindex(lenv* e, int first) {
+    if (e->count <= LENV_INDEX) { return; }
+    if (!e->index || e->count * 2 > e->size) {
+        lenv_index(e);
+        return;
+    }
+    for (int i = first; i < e->count; i++) {
+        int j = e->syms[i]->hash & (e->size - 1);
+        while (e->index[j] != -1) { j = (j + 1) & (e->size - 1); }
+        e->index[j] = i;
+    }
+}
+
+int lenv_find(lenv* e, lsym* k) {
+    if (!e->index) {
+        for (int i = 0; i < e->count; i++) {
+            if (e->syms[i] == k) { return i; }
+        }
+        return -1;
+    }
+
+    int j = k->hash & (e->size - 1);
+    while (e->index[j] != -1) {
+        if (e->syms[e->index[j]] == k) { return e->index[j]; }
+        j = (j + 1) & (e->size - 1);
+    }
+    return -1;
+}
+
+lenv* lenv_alloc(void) {
+    lenv* e = arena.on ? larena_alloc(sizeof(lenv)) : NULL;
+    if (e) {
+        e->arena = 1;
+    } else {
+        e = lpool_alloc(lenv_pools, sizeof(lenv));
+        e->arena = 0;
+    }
+    e->rc = 1;
+    return e;
+}
+
+/* makes room for n bindings */
+void lenv_grow(lenv* e, int n) {
+    if (n <= LENV_INLINE) {
+        e->syms = e->isyms;
+        e->vals = e->ivals;
+    } else if (e->syms == e->isyms) {
+        e->syms = malloc(sizeof(lsym*) * n);
+        e->vals = malloc(sizeof(lval*) * n);
+        memcpy(e->syms, e->isyms, sizeof(lsym*) * e->count);
+        memcpy(e->vals, e->ivals, sizeof(lval*) * e->count);
+    } else {
+        e->syms = realloc(e->syms, sizeof(lsym*) * n);
+        e->vals = realloc(e->vals, sizeof(lval*) * n);
+    }
+}
+
 lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
+    lenv* e = lenv_alloc();
     e->par = NULL;
     e->count = 0;
-    e->syms = NULL;
-    e->vals = NULL;
+    e->syms = e->isyms;
+    e->vals = e->ivals;
+    e->index = NULL;
+    e->size = 0;
     return e;
 }
 
-void lenv_del(lenv* e) {
-    for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+/* closures share their environment, a call binds its arguments in a
+   fresh frame copied from it */
+lenv* lenv_ref(lenv* e) {
+    e->rc++;
+    return e;
+}
+
+/* releases the storage, the values are left to the caller */
+void lenv_free(lenv* e) {
+    for (int i = 0; i < e->count; i++) { lsym_bind(e->syms[i], -1); }
+
+    if (e->syms != e->isyms) {
+        free(e->syms);
+        free(e->vals);
+    }
+    free(e->index);
+    if (e->arena) {
+        larena_free(e);
+    } else {
+        lpool_free(lenv_pools, e, sizeof(lenv));
     }
+}
+
+void lenv_del(lenv* e) {
+    if (--e->rc > 0) { return; }
 
-    free(e->syms);
-    free(e->vals);
-    free(e);
+    for (int i = 0; i < e->count; i++) { lval_del(e->vals[i]); }
+    lenv_free(e);
 }
 
 lenv* lenv_copy(lenv* e) {
-    lenv* n = malloc(sizeof(lenv));
+    lenv* n = lenv_alloc();
     n->par = e->par;
+    n->count = 0;
+    n->syms = n->isyms;
+    lenv_grow(n, e->count);
     n->count = e->count;
-    n->syms = malloc(sizeof(char*) * n->count);
-    n->vals = malloc(sizeof(lval*) * n->count);
     for (int i = 0; i < e->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+        n->syms[i] = e->syms[i];
+        lsym_bind(n->syms[i], 1);
+        n->vals[i] = lval_keep(n->arena, lval_ref(e->vals[i]));
+    }
+    n->size = e->size;
+    n->index = NULL;
+    if (e->index) {
+        n->index = malloc(sizeof(int) * n->size);
+        memcpy(n->index, e->index, sizeof(int) * n->size);
     }
     return n;
 }
 
+/* a heap closure never shares a nursery environment */
+lenv* lenv_keep(int arena, lenv* e) {
+    return e->arena && !arena ? lenv_copy(e) : lenv_ref(e);
+}
+
+/* the value bound to k, still owned by the scope it is bound in, NULL
+   when there is none. It is only good until something rebinds k */
 lval* lenv_get(lenv* e, lval* k) {
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
+    for (; e; e = e->par) {
+        int i = lenv_find(e, k->sym);
+        if (i != -1) {
+            if (!e->par && k->sym->binds == 1) { k->sym->global = e->vals[i]; }
+            return e->vals[i];
         }
     }
-
-    if (e->par) {
-        return lenv_get(e->par, k);
-    } else {
-        return lval_err("Unbound Symbol '%s'", k->sym);
-    }
+    return NULL;
 }
 
 void lenv_put(lenv* e, lval* k, lval* v) {
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
-        }
+    int i = lenv_find(e, k->sym);
+    if (i != -1) {
+        lsym_bind(k->sym, 0);
+        lval_del(e->vals[i]);
+        e->vals[i] = lval_keep(e->arena, lval_ref(v));
+        return;
     }
 
+    lenv_grow(e, e->count + 1);
     e->count++;
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
-    e->vals[e->count-1] = lval_copy(v);
-    e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-    strcpy(e->syms[e->count-1], k->sym);
+    e->vals[e->count-1] = lval_keep(e->arena, lval_ref(v));
+    e->syms[e->count-1] = k->sym;
+    lsym_bind(k->sym, 1);
+    lenv_reindex(e, e->count-1);
 }
 
-void lenv_def(lenv* e, lval* k, lval* v) {
-    while (e->par) { e = e->par; }
-    lenv_put(e, k, v);
+/* a symbol resolved by builtin_lambda is checked against its slot in the
+   calling frame, anything else not cached as a global walks the scopes.
+   Readers done with the value before any code runs borrow it from here */
+lval* lenv_peek(lenv* e, lval* k) {
+    if (k->slot >= 0 && k->slot < e->count && e->syms[k->slot] == k->sym) {
+        return e->vals[k->slot];
+    }
+    if (k->sym->global) { return k->sym->global; }
+    return lenv_get(e, k);
+}
+
+lval* lenv_lookup(lenv* e, lval* k) {
+    lval* x = lenv_peek(e, k);
+    if (!x) { return lval_err("Unbound Symbol '%s'", k->sym->name); }
+    return lval_ref(x);
 }
 
-#define LASSERT(args, cond, fmt, ...)   \
-    if (!(cond)) {  \
-        lval* err = lval_err(fmt, ##__VA_ARGS__);   \
-        lval_del(args); \
-        return err; \
+/* adds n bindings in one go, the formals are distinct symbols not yet
+   bound in e. The values are taken */
+void lenv_bind(lenv* e, lval** formals, lval** vals, int n) {
+    int first = e->count;
+    lenv_grow(e, e->count + n);
+    for (int i = 0; i < n; i++) {
+        e->syms[e->count] = formals[i]->sym;
+        e->vals[e->count++] = lval_keep(e->arena, vals[i]);
+        lsym_bind(formals[i]->sym, 1);
     }
+    lenv_reindex(e, first);
+}
 
-#define LASSERT_TYPE(func, args, index, expect) \
-    LASSERT(args, args->cell[index]->type == expect, \
-      "Function '%s' passed incorrect type for argument %i. Got %s, \
-       Expected %s", func, index, ltype_name(args->cell[index]->type), \
-          ltype_name(expect))
+void lenv_def(lenv* e, lval* k, lval* v) {
+    while (e->par) { e = e->par; }
+    lenv_put(e, k, v);
+}
 
-#define LASSERT_NUM(func, args, num) \
-    LASSERT(args, args->count == num, \
-            "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
-            func, args->count, num)
+/* Garbage Collector */
+
+/* reference counting frees a value as soon as nothing holds it, what it
+   cannot see is a value held only by others that nothing reaches, such as
+   a cycle. The collector finds those by tracing the lists and lambdas in
+   the pools from the roots. It only runs between top-level forms, where
+   the evaluation stack is empty and the only roots are the global
+   environment and the cons table.
+
+   A cycle marks, then sweeps in two passes, the first releasing what the
+   garbage holds of the live values and the second freeing it, so no node
+   is read after it is freed. With a budget it takes one bounded step
+   after each top-level form, otherwise it runs a whole cycle at once. A
+   cycle starts once LGC_TRIGGER more values than were found alive have
+   been made, or after (gc).
+
+   Marking is tri-color: white nodes have a color other than the cycle's
+   epoch, grey ones are on the stack, black ones are scanned. The stack
+   holds a reference to each, and lval_keep shades whatever is stored
+   into a parent while a mark is under way, so a scanned node never points
+   at one the mark has not reached. New nodes are white while marking and
+   black while sweeping */
+#define LGC_TRIGGER 100000
+
+enum { LGC_IDLE, LGC_MARK, LGC_DROP, LGC_FREE };
+
+typedef struct lgc {
+    long collections;
+    long reclaimed;
+    long pause_total;
+    long pause_max;
+
+    long budget;
+    long steps;
+    long work;
+    long marked;
+    long allocs;
+    int request;
+
+    /* the cycle under way, with where it has got to in the roots and in
+       the slabs */
+    int phase;
+    unsigned char epoch;
+    lenv* root;
+    int roots;
+    int cls;
+    char* slab;
+    char* node;
+    lstack grey;
+} lgc;
+
+lgc gc;
+
+int lgc_traced(lval* v) {
+    if (LVAL_IS_INT(v) || v->arena) { return 0; }
+    if (v->type == LVAL_FUN) { return v->builtin == NULL; }
+    return v->type == LVAL_SEXPR || v->type == LVAL_QEXPR;
+}
 
-#define LASSERT_NOT_EMPTY(func, args, index) \
-    LASSERT(args, args->cell[index]->count != 0, \
-            "Function '%s' passed {} for argument %i.", func, index);
+int lgc_white(lval* v) {
+    return lgc_traced(v) && v->color != gc.epoch;
+}
 
-lval* lval_eval(lenv* e, lval* v);
+void lgc_shade(lval* v) {
+    if (!lgc_white(v)) { return; }
+    v->color = gc.epoch;
+    lstack_push(&gc.grey, lval_ref(v));
+}
 
-lval* builtin_lambda(lenv* e, lval* a) {
-    LASSERT_NUM("\\", a, 2);
-    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-    LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+void lcode_each(lcode* c, void (*fn)(lval*));
+void lcode_drop(lcode* c, void (*release)(lval*));
+
+void lgc_scan(lval* v) {
+    if (v->type == LVAL_FUN) {
+        lgc_shade(v->fun->formals);
+        lgc_shade(v->fun->body);
+        if (v->fun->args) { lgc_shade(v->fun->args); }
+        for (int i = 0; i < v->fun->env->count; i++) { lgc_shade(v->fun->env->vals[i]); }
+        if (v->fun->code) { lcode_each(v->fun->code, lgc_shade); }
+        gc.work += v->fun->env->count;
+    } else {
+        for (int i = 0; i < v->count; i++) { lgc_shade(v->cell[i]); }
+        gc.work += v->count;
+    }
+    gc.work++;
+    gc.marked++;
+    lval_del(v);
+}
 
-    for (int i = 0; i < a->cell[0]->count; i++) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-                "Cannot defin non-symbol, Got %s, Expected %s.",
-                ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+/* garbage only points at garbage or at values with other owners */
+void lgc_release(lval* v) {
+    if (lgc_white(v)) { return; }
+    lval_del(v);
+}
+
+/* the last garbage closure holding an environment frees it */
+void lgc_unbind(lenv* e) {
+    if (--e->rc > 0) { return; }
+
+    gc.reclaimed += sizeof(lenv) + e->count * (sizeof(lsym*) + sizeof(lval*))
+        + e->size * sizeof(int);
+    for (int i = 0; i < e->count; i++) { lgc_release(e->vals[i]); }
+    lenv_free(e);
+}
+
+void lgc_drop(lval* v) {
+    if (v->type != LVAL_FUN) {
+        for (int i = 0; i < v->count; i++) { lgc_release(v->cell[i]); }
+        return;
     }
 
-    lval* formals = lval_pop(a, 0);
-    lval* body = lval_pop(a, 0);
-    lval_del(a);
+    lgc_release(v->fun->formals);
+    lgc_release(v->fun->body);
+    if (v->fun->args) { lgc_release(v->fun->args); }
+    lgc_unbind(v->fun->env);
+    lcode_drop(v->fun->code, lgc_release);
+}
+
+void lgc_free(lval* v) {
+    gc.reclaimed += lval_size(v);
+    if (v->type != LVAL_FUN) {
+        gc.reclaimed += v->count * sizeof(lval*);
+        free(v->cell);
+    }
+    lval_free(v);
+}
 
-    return lval_lambda(formals, body);
+void lgc_walk(char* slab) {
+    gc.slab = slab;
+    gc.node = slab ? slab + LPOOL_ALIGN : NULL;
 }
 
-lval* builtin_list(lenv* e, lval* a) {
-    a->type = LVAL_QEXPR;
-    return a;
+/* the next white node in the slabs, NULL once they are done. Slabs added
+   since the pass began are at the front and only hold black nodes */
+lval* lgc_next(void) {
+    while (gc.cls < LPOOL_CLASSES) {
+        size_t sz = (gc.cls + 1) * LPOOL_ALIGN;
+        while (gc.slab) {
+            for (; gc.node + sz <= gc.slab + LPOOL_SLAB; gc.node += sz) {
+                lval* v = (lval*)gc.node;
+                gc.work++;
+                if (v->type != LPOOL_FREE && lgc_white(v)) {
+                    gc.node += sz;
+                    return v;
+                }
+            }
+            lgc_walk(*(char**)gc.slab);
+        }
+        if (++gc.cls < LPOOL_CLASSES) { lgc_walk(lval_pools[gc.cls].slabs); }
+    }
+    return NULL;
 }
 
+void lgc_pass(int phase) {
+    gc.phase = phase;
+    gc.cls = 0;
+    lgc_walk(lval_pools[0].slabs);
+}
 
-lval* builtin_head(lenv* e, lval* a) {
-    LASSERT_NUM("head", a, 1);
-    LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY("head", a, 0);
+void lgc_begin(void) {
+    gc.epoch = gc.epoch == UCHAR_MAX ? 1 : gc.epoch + 1;
+    gc.phase = LGC_MARK;
+    gc.roots = 0;
+    gc.marked = 0;
+    lgc_marking = 1;
+    for (int i = 0; i < constab.size; i++) {
+        if (constab.slots[i].v) { lgc_shade(constab.slots[i].v); }
+    }
+}
 
-    lval* v = lval_take(a, 0);
-    while (v->count > 1) { lval_del(lval_pop(v, 1)); }
-    return v;
+void lgc_pause(clock_t start) {
+    long pause = (clock() - start) * 1000000 / CLOCKS_PER_SEC;
+    gc.pause_total += pause;
+    if (pause > gc.pause_max) { gc.pause_max = pause; }
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
-    LASSERT_NUM("tail", a, 1);
-    LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY("tail", a, 0);
+/* works on the cycle under way, starting one if there is none, until it
+   ends or budget nodes have been looked at. A negative budget has no end */
+void lgc_step(long budget) {
+    clock_t start = clock();
+    if (gc.phase == LGC_IDLE) { lgc_begin(); }
+    gc.work = 0;
+
+    while (gc.phase != LGC_IDLE && (budget < 0 || gc.work < budget)) {
+        lval* v;
+        switch (gc.phase) {
+            case LGC_MARK:
+                if (gc.roots < gc.root->count) {
+                    lgc_shade(gc.root->vals[gc.roots++]);
+                    gc.work++;
+                } else if ((v = lstack_pop(&gc.grey))) {
+                    lgc_scan(v);
+                } else {
+                    lgc_marking = 0;
+                    lval_color = gc.epoch;
+                    lgc_pass(LGC_DROP);
+                }
+                break;
+            case LGC_DROP:
+                if ((v = lgc_next())) { lgc_drop(v); } else { lgc_pass(LGC_FREE); }
+                break;
+            case LGC_FREE:
+                if ((v = lgc_next())) { lgc_free(v); break; }
+                lval_color = 0;
+                gc.phase = LGC_IDLE;
+                gc.allocs = lval_allocs;
+                gc.collections++;
+                break;
+        }
+    }
 
-    lval* v = lval_take(a, 0);
-    lval_del(lval_pop(v, 0));
-    return v;
+    gc.steps++;
+    lgc_pause(start);
 }
 
-lval* builtin_eval(lenv* e, lval* a) {
-    LASSERT_NUM("eval", a, 1);
-    LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
+/* called between top-level forms with the global environment e. Without
+   a budget a cycle runs whole, finishing first any left by a change of
+   budget */
+void lgc_safepoint(lenv* e) {
+    int start = gc.request || lval_allocs - gc.allocs >= LGC_TRIGGER + gc.marked;
+    gc.request = 0;
+    gc.root = e;
+    if (gc.phase == LGC_IDLE && !start) { return; }
+
+    if (gc.budget) {
+        lgc_step(gc.budget);
+        return;
+    }
+    if (gc.phase != LGC_IDLE) { lgc_step(-1); }
+    if (start) { lgc_step(-1); }
+}
 
-    lval* x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+/* a cycle left half done at exit still holds references */
+void lgc_cleanup(lenv* e) {
+    gc.root = e;
+    if (gc.phase != LGC_IDLE) { lgc_step(-1); }
+    free(gc.grey.items);
 }
 
-lval* builtin_join(lenv* e, lval* a) {
+/* checks for builtins, which return the error and leave argv alone */
+#define LASSERT_ARGV(cond, fmt, ...) \
+    if (!(cond)) { return lval_err(fmt, ##__VA_ARGS__); }
 
-    for (int i = 0; i < a->count; i++) {
-        LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+#define LASSERT_ARGV_TYPE(func, argv, index, expect) \
+    LASSERT_ARGV(LTYPE(argv[index]) == expect, \
+      "Function '%s' passed incorrect type for argument %i. Got %s, \
+       Expected %s", func, index, ltype_name(LTYPE(argv[index])), \
+          ltype_name(expect))
+
+#define LASSERT_ARGV_NUM(func, argc, num) \
+    LASSERT_ARGV(argc == num, \
+            "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
+            func, argc, num)
+
+#define LASSERT_ARGV_NOT_EMPTY(func, argv, index) \
+    LASSERT_ARGV(argv[index]->count != 0, \
+            "Function '%s' passed {} for argument %i.", func, index);
+
+lval* lval_eval(lenv* e, lval* v);
+lval* lval_eval_sexpr(lenv* e, lval** v, int n);
+
+/* the slot lval_call binds a formal to, the '&' marker takes none */
+int lval_slot(lval* formals, lsym* y) {
+    int slot = 0;
+    for (int i = 0; i < formals->count; i++) {
+        if (formals->cell[i]->sym == lsym_amp) { continue; }
+        if (formals->cell[i]->sym == y) { return slot; }
+        slot++;
     }
+    return -1;
+}
 
-    lval* x = lval_pop(a, 0);
+/* whether every symbol in v already records its slot in formals */
+int lval_resolved(lval* v, lval* formals) {
+    lstack s = { NULL, 0, 0 };
+    int resolved = 1;
+    for (; v && resolved; v = lstack_pop(&s)) {
+        for (int i = 0; i < v->count && resolved; i++) {
+            lval* x = v->cell[i];
+            switch (LTYPE(x)) {
+                case LVAL_SYM: resolved = x->slot == lval_slot(formals, x->sym); break;
+                case LVAL_SEXPR:
+                case LVAL_QEXPR: lstack_push(&s, x); break;
+            }
+        }
+    }
+    free(s.items);
+    return resolved;
+}
 
-    while (a->count) {
-        x = lval_join(x, lval_pop(a, 0));
+/* lexical addressing, every symbol in the body (if branches included)
+   records the slot of the formal it names or -1. The body is taken and
+   may be shared with a literal or another lambda, so unless it is
+   resolved for formals already its shared nodes are copied before they
+   are written */
+lval* lval_resolve(lval* v, lval* formals) {
+    if (lval_resolved(v, formals)) { return v; }
+
+    lstack s = { NULL, 0, 0 };
+    v = lval_unshare(v);
+    for (lval* x = v; x; x = lstack_pop(&s)) {
+        for (int i = 0; i < x->count; i++) {
+            lval* y = x->cell[i];
+            switch (LTYPE(y)) {
+                case LVAL_SYM: {
+                    int slot = lval_slot(formals, y->sym);
+                    if (y->slot == slot) { break; }
+                    y = lval_unshare(y);
+                    y->slot = slot;
+                    x->cell[i] = lval_keep(x->arena, y);
+                    break;
+                }
+                case LVAL_SEXPR:
+                case LVAL_QEXPR:
+                    x->cell[i] = lval_keep(x->arena, lval_unshare(y));
+                    lstack_push(&s, x->cell[i]);
+                    break;
+            }
+        }
     }
+    free(s.items);
+    return v;
+}
 
-    lval_del(a);
+lval* builtin_lambda(lenv* e, lval** argv, int argc) {
+    for (int i = 0; i < argv[0]->count; i++) {
+        LASSERT_ARGV((LTYPE(argv[0]->cell[i]) == LVAL_SYM),
+                "Cannot defin non-symbol, Got %s, Expected %s.",
+                ltype_name(LTYPE(argv[0]->cell[i])), ltype_name(LVAL_SYM));
+    }
+
+    lval* formals = lval_ref(argv[0]);
+    lval* body = lval_resolve(lval_ref(argv[1]), formals);
+
+    lval* f = lval_lambda(formals, body);
+    f->fun->code = lcode_new(e, formals, body);
+    return f;
+}
+
+lval* builtin_list(lenv* e, lval** argv, int argc) {
+    lval* x = lval_qexpr();
+    for (int i = 0; i < argc; i++) { x = lval_add(x, lval_ref(argv[i])); }
     return x;
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
 
-    for (int i = 0; i < a->count; i++) {
-        LASSERT_TYPE(op, a, i, LVAL_NUM); 
-    }
+lval* builtin_head(lenv* e, lval** argv, int argc) {
+    LASSERT_ARGV_NOT_EMPTY("head", argv, 0);
 
-    lval* x = lval_pop(a, 0);
+    return lval_add(lval_qexpr(), lval_ref(argv[0]->cell[0]));
+}
 
-    if ((strcmp(op, "-") == 0) && a->count == 0) { x->num = -x->num; }
+lval* builtin_tail(lenv* e, lval** argv, int argc) {
+    LASSERT_ARGV_NOT_EMPTY("tail", argv, 0);
 
-    while (a->count > 0) {
+    lval* v = argv[0];
+    lval* x = lval_qexpr();
+    x->count = v->count - 1;
+    x->cell = malloc(sizeof(lval*) * x->count);
+    for (int i = 0; i < x->count; i++) {
+        x->cell[i] = lval_keep(x->arena, lval_ref(v->cell[i + 1]));
+    }
+    return x;
+}
 
-        lval* y = lval_pop(a, 0);
+lval* builtin_eval(lenv* e, lval** argv, int argc) {
+    return lval_eval_sexpr(e, argv[0]->cell, argv[0]->count);
+}
 
-        if (strcmp(op, "+") == 0) { x->num += y->num; }
-        if (strcmp(op, "-") == 0) { x->num -= y->num; }
-        if (strcmp(op, "*") == 0) { x->num *= y->num; }
-        if (strcmp(op, "/") == 0) { 
-            if (y->num == 0) {
-                lval_del(x); lval_del(y);
-                x = lval_err("Division by zero.");
-                break;
-            } else {
-                x->num /= y->num;
-            }
-        }
+lval* builtin_join(lenv* e, lval** argv, int argc) {
+    lval* x = lval_ref(argv[0]);
 
-        /* delete element now finish with */
-        lval_del(y);
+    for (int i = 1; i < argc; i++) {
+        x = lval_join(x, lval_ref(argv[i]));
     }
 
-    /* delete input expression and return result */
-    lval_del(a);
     return x;
 }
 
-lval *builtin_add(lenv* e, lval* a) { return builtin_op(e, a, "+"); }
-lval *builtin_sub(lenv* e, lval* a) { return builtin_op(e, a, "-"); }
-lval *builtin_mul(lenv* e, lval* a) { return builtin_op(e, a, "*"); }
-lval *builtin_div(lenv* e, lval* a) { return builtin_op(e, a, "/"); }
+/* x op y into r, or 0 when it does not fit in a long. Signed overflow
+   is undefined in C, so it is an error in Lispy rather than a wrap */
+int lnum_op(int op, long x, long y, long* r) {
+#if defined(__GNUC__)
+    switch (op) {
+        case LB_ADD: return !__builtin_add_overflow(x, y, r);
+        case LB_SUB: return !__builtin_sub_overflow(x, y, r);
+        case LB_MUL: return !__builtin_mul_overflow(x, y, r);
+    }
+#else
+    switch (op) {
+        case LB_ADD:
+            if (y > 0 ? x > LONG_MAX - y : x < LONG_MIN - y) { return 0; }
+            *r = x + y;
+            return 1;
+        case LB_SUB:
+            if (y < 0 ? x > LONG_MAX + y : x < LONG_MIN + y) { return 0; }
+            *r = x - y;
+            return 1;
+        case LB_MUL:
+            if (x > 0 ? (y > 0 ? x > LONG_MAX / y : y < LONG_MIN / x)
+                      : (y > 0 ? x < LONG_MIN / y : x != 0 && y < LONG_MAX / x)) {
+                return 0;
+            }
+            *r = x * y;
+            return 1;
+    }
+#endif
+    /* LB_DIV, y is not zero */
+    if (x == LONG_MIN && y == -1) { return 0; }
+    *r = x / y;
+    return 1;
+}
+
+/* op is a constant in each caller below, which lets the compiler give
+   every one of them its own loop with the switch folded away */
+lval* builtin_op(lenv* e, lval** argv, int argc, int op) {
+    long x = LNUM(argv[0]);
+
+    if (op == LB_SUB && argc == 1 && !lnum_op(LB_SUB, 0, x, &x)) {
+        return lval_err("Integer overflow.");
+    }
 
-lval *builtin_var(lenv* e, lval* a, char* func) {
-    LASSERT_TYPE("def", a, 0, LVAL_QEXPR);
+    for (int i = 1; i < argc; i++) {
 
-    lval* syms = a->cell[0];
+        long y = LNUM(argv[i]);
+
+        if (op == LB_DIV && y == 0) {
+            return lval_err("Division by zero.");
+        }
+        if (!lnum_op(op, x, y, &x)) {
+            return lval_err("Integer overflow.");
+        }
+    }
+
+    return lval_num(x);
+}
+
+lval *builtin_add(lenv* e, lval** argv, int argc) { return builtin_op(e, argv, argc, LB_ADD); }
+lval *builtin_sub(lenv* e, lval** argv, int argc) { return builtin_op(e, argv, argc, LB_SUB); }
+lval *builtin_mul(lenv* e, lval** argv, int argc) { return builtin_op(e, argv, argc, LB_MUL); }
+lval *builtin_div(lenv* e, lval** argv, int argc) { return builtin_op(e, argv, argc, LB_DIV); }
+
+lval *builtin_var(lenv* e, lval** argv, int argc, int op) {
+    lval* syms = argv[0];
 
     for (int i = 0; i < syms->count; i++) {
-        LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+        LASSERT_ARGV((LTYPE(syms->cell[i]) == LVAL_SYM),
                 "Function 'def' cannot define non-symbol. Got %s, Expected %s.",
-                ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+                ltype_name(LTYPE(syms->cell[i])), ltype_name(LVAL_SYM));
     }
 
-    LASSERT(a, (syms->count == a->count - 1),
+    LASSERT_ARGV((syms->count == argc - 1),
             "Function 'def' passed too many arguments for symbols. Got %i, Expected %i.",
-            syms->count, a->count-1);
+            syms->count, argc - 1);
 
     for (int i = 0; i < syms->count; i++) {
-        if (strcmp(func, "def") == 0) {
-            lenv_def(e, syms->cell[i], a->cell[i + 1]);
-        }
-        if (strcmp(func, "=") == 0) {
-            lenv_put(e, syms->cell[i], a->cell[i + 1]);
+        if (op == LB_DEF) {
+            lenv_def(e, syms->cell[i], argv[i + 1]);
+        } else {
+            lenv_put(e, syms->cell[i], argv[i + 1]);
         }
     }
 
-    lval_del(a);
     return lval_sexpr();
 }
 
-lval* builtin_def(lenv* e, lval* a) { return builtin_var(e, a, "def"); }
-lval* builtin_put(lenv* e, lval* a) { return builtin_var(e, a, "="); }
+lval* builtin_def(lenv* e, lval** argv, int argc) { return builtin_var(e, argv, argc, LB_DEF); }
+lval* builtin_put(lenv* e, lval** argv, int argc) { return builtin_var(e, argv, argc, LB_PUT); }
 
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-    LASSERT_NUM(op, a, 2);
-    LASSERT_TYPE(op, a, 0, LVAL_NUM);
-    LASSERT_TYPE(op, a, 1, LVAL_NUM);
+lval* builtin_ord(lenv* e, lval** argv, int argc, int op) {
+    long x = LNUM(argv[0]);
+    long y = LNUM(argv[1]);
 
-    int r;
-    if(strcmp(op, ">") == 0) { r = (a->cell[0]->num > a->cell[1]->num); }
-    if(strcmp(op, "<") == 0) { r = (a->cell[0]->num < a->cell[1]->num); }
-    if(strcmp(op, ">=")== 0) { r = (a->cell[0]->num >=a->cell[1]->num); }
-    if(strcmp(op, "<=")== 0) { r = (a->cell[0]->num <=a->cell[1]->num); }
-    lval_del(a);
-    return lval_num(r);
-}
-
-lval* builtin_gt(lenv* e, lval* a) { return builtin_ord(e, a, ">"); }
-lval* builtin_lt(lenv* e, lval* a) { return builtin_ord(e, a, "<"); }
-lval* builtin_ge(lenv* e, lval* a) { return builtin_ord(e, a, ">=");}
-lval* builtin_le(lenv* e, lval* a) { return builtin_ord(e, a, "<=");}
-
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-    LASSERT_NUM(op, a, 2);
-    int r;
-    if (strcmp(op, "==") == 0) { r = lval_eq(a->cell[0], a->cell[1]); }
-    if (strcmp(op, "!=") == 0) { r = !lval_eq(a->cell[0], a->cell[1]);}
-    lval_del(a);
-    return lval_num(r);
+    switch (op) {
+        case LB_GT: return lval_num(x > y);
+        case LB_LT: return lval_num(x < y);
+        case LB_GE: return lval_num(x >= y);
+        default:    return lval_num(x <= y);
+    }
 }
 
-lval* builtin_eq(lenv* e, lval* a) { return builtin_cmp(e, a, "=="); }
-lval* builtin_ne(lenv* e, lval* a) { return builtin_cmp(e, a, "!="); }
-
-lval* builtin_if(lenv* e, lval* a) {
-    LASSERT_NUM("if", a, 3);
-    LASSERT_TYPE("if", a, 0, LVAL_NUM);
-    LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-    LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
-
-    lval* x;
-    a->cell[1]->type = LVAL_SEXPR;
-    a->cell[2]->type = LVAL_SEXPR;
+lval* builtin_gt(lenv* e, lval** argv, int argc) { return builtin_ord(e, argv, argc, LB_GT); }
+lval* builtin_lt(lenv* e, lval** argv, int argc) { return builtin_ord(e, argv, argc, LB_LT); }
+lval* builtin_ge(lenv* e, lval** argv, int argc) { return builtin_ord(e, argv, argc, LB_GE); }
+lval* builtin_le(lenv* e, lval** argv, int argc) { return builtin_ord(e, argv, argc, LB_LE); }
 
-    if (a->cell[0]->num) {
-        x = lval_eval(e, lval_pop(a, 1));
-    } else {
-        x = lval_eval(e, lval_pop(a, 2));
-    }
+lval* builtin_eq(lenv* e, lval** argv, int argc) { return lval_num(lval_eq(argv[0], argv[1])); }
+lval* builtin_ne(lenv* e, lval** argv, int argc) { return lval_num(!lval_eq(argv[0], argv[1])); }
 
-    lval_del(a);
-    return x;
+lval* builtin_if(lenv* e, lval** argv, int argc) {
+    lval* x = LNUM(argv[0]) ? argv[1] : argv[2];
+    return lval_eval_sexpr(e, x->cell, x->count);
 }
 
 lval* lval_read(mpc_ast_t* t);
 
-lval* builtin_load(lenv* e, lval* a) {
-    LASSERT_NUM("load", a, 1);
-    LASSERT_TYPE("load", a, 0, LVAL_STR);
-
+lval* builtin_load(lenv* e, lval** argv, int argc) {
     mpc_result_t r;
-    if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
-        lval* expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
-
-        while (expr->count) {
-            lval* x = lval_eval(e, lval_pop(expr, 0));
-            if (x->type == LVAL_ERR) { lval_println(x); }
+    if (mpc_parse_contents(argv[0]->str, Lispy, &r)) {
+        /* each form is read just before it runs, so what it sets such as
+           hash consing applies to the forms after it */
+        mpc_ast_t* t = r.output;
+        for (int i = 0; i < t->children_num; i++) {
+            if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
+            int region = larena_begin();
+            lval* x = lval_eval(e, lval_read(t->children[i]));
+            if (LTYPE(x) == LVAL_ERR) { lval_println(x); }
             lval_del(x);
+            larena_end(region);
+            if (region) { lgc_safepoint(e); }
         }
 
-        lval_del(expr);
-        lval_del(a);
+        mpc_ast_delete(r.output);
 
         return lval_sexpr();
     } else {
@@ -632,169 +1817,1743 @@ lval* builtin_load(lenv* e, lval* a) {
 
         lval* err = lval_err("Could not load Library %s", err_msg);
         free(err_msg);
-        lval_del(a);
 
         return err;
     }
 }
 
-lval* builtin_print(lenv* e, lval* a) {
-    for (int i = 0; i < a->count; i++) {
-        lval_print(a->cell[i]); 
+lval* builtin_print(lenv* e, lval** argv, int argc) {
+    for (int i = 0; i < argc; i++) {
+        lval_print(argv[i]); 
         putchar(' ');
     }
     putchar('\n');
-    lval_del(a);
 
     return lval_sexpr();
 }
 
-lval* builtin_error(lenv* e, lval* a) {
-    LASSERT_NUM("error", a, 1);
-    LASSERT_TYPE("error", a, 0, LVAL_STR);
+lval* builtin_error(lenv* e, lval** argv, int argc) {
+    return lval_err(argv[0]->str);
+}
 
-    lval* err = lval_err(a->cell[0]->str);
-    lval_del(a);
-    return err;
+/* the cycle starts once the current top-level form is done */
+lval* builtin_gc(lenv* e, lval** argv, int argc) {
+    gc.request = 1;
+    return lval_sexpr();
+}
+
+lval* builtin_gc_stats(lenv* e, lval** argv, int argc) {
+    printf("collections: %li\n", gc.collections);
+    printf("bytes reclaimed: %li\n", gc.reclaimed);
+    printf("incremental steps: %li, budget: %li\n", gc.steps, gc.budget);
+    printf("pause total: %li us, max: %li us\n", gc.pause_total, gc.pause_max);
+
+    return lval_sexpr();
+}
+
+lval* builtin_gc_max_pause(lenv* e, lval** argv, int argc) {
+    return lval_num(gc.pause_max);
+}
+
+/* the most nodes a step looks at between two top-level forms, 0 runs each
+   cycle with the world stopped */
+lval* builtin_gc_budget(lenv* e, lval** argv, int argc) {
+    LASSERT_ARGV(LNUM(argv[0]) >= 0,
+            "Function 'gc-budget' passed a negative budget.");
+
+    long old = gc.budget;
+    gc.budget = LNUM(argv[0]);
+
+    return lval_num(old);
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-    lval* k = lval_sym(name);
-    lval* v = lval_builtin(func);
+lval* builtin_pool_stats(lenv* e, lval** argv, int argc) {
+    printf("lval allocations: %li\n", lval_allocs);
+    for (int c = 0; c < LPOOL_CLASSES; c++) {
+        if (lval_pools[c].hits == 0 && lval_pools[c].misses == 0) { continue; }
+        printf("lval pool %3i bytes: %li hits, %li misses\n",
+               (c + 1) * LPOOL_ALIGN, lval_pools[c].hits, lval_pools[c].misses);
+    }
+    for (int c = 0; c < LPOOL_CLASSES; c++) {
+        if (lenv_pools[c].hits == 0 && lenv_pools[c].misses == 0) { continue; }
+        printf("lenv pool %3i bytes: %li hits, %li misses\n",
+               (c + 1) * LPOOL_ALIGN, lenv_pools[c].hits, lenv_pools[c].misses);
+    }
+
+    return lval_sexpr();
+}
+
+/* checks the arguments once against the descriptor and runs the builtin,
+   which can then rely on them */
+lval* builtin_call(lenv* e, const lbdesc* d, lval** argv, int argc) {
+    if (d->min == d->max) {
+        LASSERT_ARGV_NUM(d->name, argc, d->min);
+    } else {
+        LASSERT_ARGV(argc >= d->min,
+                "Function '%s' passed too few arguments. Got %i, Expected at least %i.",
+                d->name, argc, d->min);
+        LASSERT_ARGV(d->max < 0 || argc <= d->max,
+                "Function '%s' passed too many arguments. Got %i, Expected at most %i.",
+                d->name, argc, d->max);
+    }
+
+    for (int i = 0; i < argc && d->ntypes; i++) {
+        int t = d->types[i < d->ntypes ? i : d->ntypes - 1];
+        if (t != LVAL_ANY) { LASSERT_ARGV_TYPE(d->name, argv, i, t); }
+    }
+
+    return d->func(e, argv, argc);
+}
+
+void lenv_add_builtin(lenv* e, const lbdesc* d) {
+    lval* k = lval_sym(d->name);
+    lval* v = lval_builtin(d);
     lenv_put(e, k, v);
     lval_del(k); lval_del(v);
 }
 
-void lenv_add_builtins(lenv* e) {
+lval* builtin_max_depth(lenv* e, lval** argv, int argc);
+lval* builtin_max_nest(lenv* e, lval** argv, int argc);
+lval* builtin_optimize(lenv* e, lval** argv, int argc);
+
+
+const lbdesc lbuiltins[] = {
     /* variable functions */
-    lenv_add_builtin(e, "\\", builtin_lambda);
-    lenv_add_builtin(e, "def", builtin_def);
-    lenv_add_builtin(e, "=", builtin_put);
+    {"\\",  builtin_lambda, LB_LAMBDA, 0, 2, 2, 2, {LVAL_QEXPR, LVAL_QEXPR}},
+    {"def", builtin_def, LB_DEF, 0, 1, -1, 2, {LVAL_QEXPR, LVAL_ANY}},
+    {"=",   builtin_put, LB_PUT, 0, 1, -1, 2, {LVAL_QEXPR, LVAL_ANY}},
 
     /* list funcitons */
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
+    {"list", builtin_list, LB_LIST, LB_PURE, 0, -1, 0, {LVAL_ANY}},
+    {"head", builtin_head, LB_HEAD, LB_PURE, 1, 1, 1, {LVAL_QEXPR}},
+    {"tail", builtin_tail, LB_TAIL, LB_PURE, 1, 1, 1, {LVAL_QEXPR}},
+    {"eval", builtin_eval, LB_EVAL, 0, 1, 1, 1, {LVAL_QEXPR}},
+    {"join", builtin_join, LB_JOIN, LB_PURE, 1, -1, 1, {LVAL_QEXPR}},
 
     /* mathematical functions */
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
+    {"+", builtin_add, LB_ADD, LB_PURE, 1, -1, 1, {LVAL_NUM}},
+    {"-", builtin_sub, LB_SUB, LB_PURE, 1, -1, 1, {LVAL_NUM}},
+    {"*", builtin_mul, LB_MUL, LB_PURE, 1, -1, 1, {LVAL_NUM}},
+    {"/", builtin_div, LB_DIV, LB_PURE, 1, -1, 1, {LVAL_NUM}},
 
     /* comparison function */
-    lenv_add_builtin(e, "if", builtin_if);
-    lenv_add_builtin(e, "==", builtin_eq);
-    lenv_add_builtin(e, "!=", builtin_ne);
-    lenv_add_builtin(e, ">",  builtin_gt);
-    lenv_add_builtin(e, "<",  builtin_le);
-    lenv_add_builtin(e, ">=", builtin_ge);
-    lenv_add_builtin(e, "<=", builtin_le);
+    {"if", builtin_if, LB_IF, 0, 3, 3, 3, {LVAL_NUM, LVAL_QEXPR, LVAL_QEXPR}},
+    {"==", builtin_eq, LB_EQ, LB_PURE, 2, 2, 0, {LVAL_ANY}},
+    {"!=", builtin_ne, LB_NE, LB_PURE, 2, 2, 0, {LVAL_ANY}},
+    {">",  builtin_gt, LB_GT, LB_PURE, 2, 2, 1, {LVAL_NUM}},
+    {"<",  builtin_lt, LB_LT, LB_PURE, 2, 2, 1, {LVAL_NUM}},
+    {">=", builtin_ge, LB_GE, LB_PURE, 2, 2, 1, {LVAL_NUM}},
+    {"<=", builtin_le, LB_LE, LB_PURE, 2, 2, 1, {LVAL_NUM}},
 
     /* string functions */
-    lenv_add_builtin(e, "load", builtin_load);
-    lenv_add_builtin(e, "error", builtin_error);
-    lenv_add_builtin(e, "print", builtin_print);
+    {"load",  builtin_load,  LB_LOAD,  0, 1, 1, 1, {LVAL_STR}},
+    {"error", builtin_error, LB_ERROR, 0, 1, 1, 1, {LVAL_STR}},
+    {"print", builtin_print, LB_PRINT, 0, 0, -1, 0, {LVAL_ANY}},
+
+    /* memory functions */
+    {"pool-stats",   builtin_pool_stats,   LB_POOL_STATS,   0, 0, 0, 0, {LVAL_ANY}},
+    {"gc",           builtin_gc,           LB_GC,           0, 0, 0, 0, {LVAL_ANY}},
+    {"gc-stats",     builtin_gc_stats,     LB_GC_STATS,     0, 0, 0, 0, {LVAL_ANY}},
+    {"gc-max-pause", builtin_gc_max_pause, LB_GC_MAX_PAUSE, 0, 0, 0, 0, {LVAL_ANY}},
+    {"gc-budget",    builtin_gc_budget,    LB_GC_BUDGET,    0, 1, 1, 1, {LVAL_NUM}},
+    {"max-depth",    builtin_max_depth,    LB_MAX_DEPTH,    0, 1, 1, 1, {LVAL_NUM}},
+    {"max-nest",     builtin_max_nest,     LB_MAX_NEST,     0, 1, 1, 1, {LVAL_NUM}},
+    {"optimize",     builtin_optimize,          LB_OPTIMIZE,     0, 1, 1, 1, {LVAL_NUM}},
+    {"hash-cons",    builtin_hash_cons,         LB_HASH_CONS,    0, 1, 1, 1, {LVAL_NUM}},
+    {NULL, NULL, 0, 0, 0, 0, 0, {0}}
+};
+
+void lenv_add_builtins(lenv* e) {
+    for (const lbdesc* d = lbuiltins; d->name; d++) { lenv_add_builtin(e, d); }
 }
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
-    if (f->builtin) { return f->builtin(e, a); }
+/* Bytecode */
 
-    int given = a->count;
-    int total = f->formals->count;
+/* a lambda whose formals are distinct symbols is compiled when it is
+   created, each S-expression of the body to the code for its elements
+   and a call, an if with literal branches to jumps. Calls in tail
+   position are LOP_TAIL, and anything the fast paths do not cover goes
+   through lval_call so it behaves as in the tree walker */
+enum {
+    LOP_CONST, LOP_SYM, LOP_CALL, LOP_TAIL, LOP_IF, LOP_JUMP, LOP_RETURN,
+    LOP_OPSN, LOP_IFOPSN, LOP_BORROW, LOP_ARG, LOP_ENTER, LOP_DROP
+};
 
-    while (a->count) {
-        if (f->formals->count == 0) {
-            lval_del(a);
-            return lval_err("Function passed too many arguments. Got %i, Expected %i", given, total);
+/* with GCC and Clang each instruction jumps straight to the next one
+   through a table of labels, LISPY_SWITCH keeps the portable switch */
+#if defined(__GNUC__) && !defined(LISPY_SWITCH)
+#define LVM_THREADED
+#endif
+
+/* compiled calls keep their state on the heap stacks of vm and may go
+   vm.limit deep, runs entered again from C nest vm.nest_limit deep and
+   stop LVM_RESERVE bytes short of the end of the C stack regardless */
+#define LVM_DEPTH 100000
+#define LVM_NEST 10000
+#define LVM_RESERVE (256 * 1024)
+#define LVM_STACK (8 * 1024 * 1024)
+
+struct lcode {
+    int* ops;
+    int count;
+    lval** consts;
+    int nconsts;
+    int arity;
+    int variadic;
+    int depth;
+    int sp;
+    int nest;
+    int rc;
+    int calls;
+    ljit* jit;
+    lval* body;
+    lval** deps;
+    lval** vals;
+    int ndeps;
+    struct lopt* opt;
+    lval* inlined;
+    int argbase;
+};
+
+typedef struct lvm_frame {
+    lcode* code;
+    int* op;
+    lenv* env;
+    lval* fn;
+    int own;
+    int base;
+} lvm_frame;
+
+typedef struct lvm {
+    lval** stack;
+    int sp;
+    int size;
+    lvm_frame* frames;
+    int depth;
+    int max;
+    long limit;
+    int nest;
+    int nest_limit;
+    uintptr_t cbase;
+    size_t csize;
+} lvm;
+
+lvm vm = { .limit = LVM_DEPTH, .nest_limit = LVM_NEST };
+
+/* the C stack of the main thread is taken to start at base, its size
+   is the soft limit, or LVM_STACK when there is none */
+void lvm_cstack(void* base) {
+    struct rlimit rl;
+    vm.cbase = (uintptr_t)base;
+    vm.csize = getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+        ? rl.rlim_cur : LVM_STACK;
+}
+
+/* the error another nested run would end in, by count and by what is
+   left of the C stack, which grows down on every platform built for */
+lval* lvm_nest_err(void) {
+    char here;
+    if (vm.nest >= vm.nest_limit) {
+        return lval_err("Maximum nesting depth %i exceeded", vm.nest_limit);
+    }
+    if (vm.cbase && vm.cbase - (uintptr_t)&here + LVM_RESERVE >= vm.csize) {
+        return lval_err("Nesting too deep for the C stack");
+    }
+    return NULL;
+}
+
+void lvm_reserve(int n) {
+    while (vm.sp + n > vm.size) {
+        vm.size = vm.size ? vm.size * 2 : 256;
+        vm.stack = realloc(vm.stack, sizeof(lval*) * vm.size);
+    }
+}
+
+lvm_frame* lvm_frame_push(void) {
+    if (vm.depth == vm.max) {
+        vm.max = vm.max ? vm.max * 2 : 64;
+        vm.frames = realloc(vm.frames, sizeof(lvm_frame) * vm.max);
+    }
+    return &vm.frames[vm.depth++];
+}
+
+lcode* lcode_ref(lcode* c) {
+    if (c) { c->rc++; }
+    return c;
+}
+
+void ljit_del(ljit* j);
+
+/* the values c holds */
+void lcode_each(lcode* c, void (*fn)(lval*)) {
+    if (c->body) { fn(c->body); }
+    for (int i = 0; i < c->ndeps; i++) {
+        fn(c->deps[i]);
+        fn(c->vals[i]);
+    }
+}
+
+/* the last reference to c frees it, handing its values to release */
+void lcode_drop(lcode* c, void (*release)(lval*)) {
+    if (!c || --c->rc > 0) { return; }
+    ljit_del(c->jit);
+    lcode_each(c, release);
+    free(c->deps);
+    free(c->vals);
+    free(c->ops);
+    free(c->consts);
+    free(c);
+}
+
+void lcode_del(lcode* c) { lcode_drop(c, lval_del); }
+
+int lcode_emit(lcode* c, int op) {
+    c->ops = realloc(c->ops, sizeof(int) * (c->count + 1));
+    c->ops[c->count] = op;
+    return c->count++;
+}
+
+int lcode_const(lcode* c, lval* x) {
+    c->consts = realloc(c->consts, sizeof(lval*) * (c->nconsts + 1));
+    c->consts[c->nconsts] = x;
+    return c->nconsts++;
+}
+
+void lcode_push(lcode* c, int n) {
+    c->sp += n;
+    if (c->sp > c->depth) { c->depth = c->sp; }
+}
+
+void lcode_sexpr(lcode* c, lval* v, int tail);
+lval* lcode_callee(lcode* c, lval* v);
+
+/* a call whose elements are all symbols or literals */
+int lcode_atoms(lval* v) {
+    if (v->count < 2 || LTYPE(v->cell[0]) != LVAL_SYM) { return 0; }
+    for (int i = 1; i < v->count; i++) {
+        if (LTYPE(v->cell[i]) == LVAL_SEXPR) { return 0; }
+    }
+    return 1;
+}
+
+/* an operator applied to a variable and a literal number */
+int lcode_opsn(lval* v) {
+    return LTYPE(v) == LVAL_SEXPR && v->count == 3
+        && LTYPE(v->cell[0]) == LVAL_SYM
+        && LTYPE(v->cell[1]) == LVAL_SYM
+        && LTYPE(v->cell[2]) == LVAL_NUM;
+}
+
+/* the three elements become consecutive constants, the instruction only
+   names the first */
+void lcode_opsn_consts(lcode* c, lval* v) {
+    lcode_emit(c, lcode_const(c, v->cell[0]));
+    lcode_const(c, v->cell[1]);
+    lcode_const(c, v->cell[2]);
+}
+
+void lcode_expr(lcode* c, lval* x) {
+    if (LTYPE(x) == LVAL_SEXPR) {
+        lcode_sexpr(c, x, 0);
+        return;
+    }
+    int slot = c->inlined && LTYPE(x) == LVAL_SYM
+        ? lval_slot(c->inlined, x->sym) : -1;
+    if (slot != -1) {
+        lcode_emit(c, LOP_ARG);
+        lcode_emit(c, c->argbase + slot);
+        lcode_push(c, 1);
+        return;
+    }
+    lcode_emit(c, LTYPE(x) == LVAL_SYM ? LOP_SYM : LOP_CONST);
+    lcode_emit(c, lcode_const(c, x));
+    lcode_push(c, 1);
+}
+
+/* if leaves the branch that ran on the stack, if it turns out not to be
+   the builtin the branches are pushed and called like any other */
+void lcode_if(lcode* c, lval* v, int tail) {
+    int fused = -1;
+    if (!c->inlined && lcode_opsn(v->cell[1])) {
+        lcode_emit(c, LOP_IFOPSN);
+        lcode_emit(c, lcode_const(c, v->cell[0]));
+        lcode_opsn_consts(c, v->cell[1]);
+        fused = lcode_emit(c, 0);
+        lcode_emit(c, 0);
+    }
+
+    lcode_expr(c, v->cell[0]);
+    lcode_expr(c, v->cell[1]);
+    lcode_push(c, 2);
+    c->sp -= 4;
+
+    lcode_emit(c, LOP_IF);
+    lcode_emit(c, lcode_const(c, v->cell[2]));
+    lcode_emit(c, lcode_const(c, v->cell[3]));
+    int other = lcode_emit(c, 0);
+    int end = lcode_emit(c, 0);
+    if (fused != -1) { c->ops[fused] = c->count; }
+
+    /* a branch in tail position never falls through */
+    lcode_sexpr(c, v->cell[2], tail);
+    int skip = -1;
+    if (!tail) {
+        lcode_emit(c, LOP_JUMP);
+        skip = lcode_emit(c, 0);
+    }
+    c->sp--;
+
+    c->ops[other] = c->count;
+    if (fused != -1) { c->ops[fused + 1] = c->count; }
+    lcode_sexpr(c, v->cell[3], tail);
+    c->ops[end] = c->count;
+    if (skip != -1) { c->ops[skip] = c->count; }
+    if (tail) { lcode_emit(c, LOP_RETURN); }
+}
+
+/* the call v of g with g's body in place of the call. LOP_ENTER checks
+   the arguments pushed for it, LOP_ARG reads them and LOP_DROP leaves
+   the result in their place, other names are looked up in the caller */
+void lcode_inline(lcode* c, lval* v, lval* g, int tail) {
+    int n = v->count - 1;
+    for (int i = 1; i <= n; i++) { lcode_expr(c, v->cell[i]); }
+    lcode_emit(c, LOP_ENTER);
+    lcode_emit(c, n);
+    int skip = lcode_emit(c, 0);
+
+    c->inlined = g->fun->formals;
+    c->argbase = c->sp - n;
+    lcode_sexpr(c, g->fun->code->body ? g->fun->code->body : g->fun->body, 0);
+    c->inlined = NULL;
+
+    lcode_emit(c, LOP_DROP);
+    lcode_emit(c, n);
+    lcode_push(c, -n);
+    c->ops[skip] = c->count;
+    if (tail) { lcode_emit(c, LOP_RETURN); }
+}
+
+void lcode_sexpr(lcode* c, lval* v, int tail) {
+    /* a body nested too deeply is left to the tree walker */
+    if (c->nest > LVM_NEST) { return; }
+    c->nest++;
+
+    lval* g;
+    if (v->count == 4 && LTYPE(v->cell[0]) == LVAL_SYM
+            && v->cell[0]->sym == lsym_if
+            && LTYPE(v->cell[2]) == LVAL_QEXPR
+            && LTYPE(v->cell[3]) == LVAL_QEXPR) {
+        lcode_if(c, v, tail);
+    } else if ((g = lcode_callee(c, v))) {
+        lcode_inline(c, v, g, tail);
+    } else {
+        int skip = -1;
+        if (c->inlined) {
+            /* the superinstructions would look the formals up */
+        } else if (lcode_opsn(v)) {
+            lcode_emit(c, LOP_OPSN);
+            lcode_opsn_consts(c, v);
+            lcode_emit(c, tail);
+            skip = lcode_emit(c, 0);
+        } else if (lcode_atoms(v)) {
+            lcode_emit(c, LOP_BORROW);
+            lcode_emit(c, lcode_const(c, v->cell[0]));
+            for (int i = 1; i < v->count; i++) { lcode_const(c, v->cell[i]); }
+            lcode_emit(c, v->count);
+            lcode_emit(c, tail);
+            skip = lcode_emit(c, 0);
         }
+        for (int i = 0; i < v->count; i++) { lcode_expr(c, v->cell[i]); }
+        lcode_emit(c, tail ? LOP_TAIL : LOP_CALL);
+        lcode_emit(c, v->count);
+        lcode_push(c, 1 - v->count);
+        if (skip != -1) { c->ops[skip] = c->count; }
+    }
+    if (c->nest <= LVM_NEST) { c->nest--; }
+}
 
-        lval* sym = lval_pop(f->formals, 0);
+/* Optimizer */
 
-        if (strcmp(sym->sym, "&") == 0) {
-            if (f->formals->count != 1) {
-                lval_del(a);
-                return lval_err("Function format invalid. Symbol '&' not followed by single symbol");
-            }
+/* a body is folded before it is compiled, pure builtins on constants
+   become their results and ifs on constants their branches. Only names
+   bound once, globally, are trusted, and code whose builtins have been
+   rebound since is compiled anew on entry. (optimize 0) turns it off */
+typedef struct lopt {
+    lenv* e;
+    lval* formals;
+    lval** deps;
+    lval** vals;
+    int ndeps;
+    int depth;
+    int deep;
+    int ran;
+    lval** sites;
+    lval** callees;
+    int nsites;
+} lopt;
+
+int lopt_on = 1;
+
+#define LCODE_INLINE 32
+
+lval* builtin_optimize(lenv* e, lval** argv, int argc) {
+    long old = lopt_on;
+    lopt_on = LNUM(argv[0]) != 0;
+    return lval_num(old);
+}
 
-            lval* nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym); lval_del(nsym);
-            break;
+/* whether v holds no functions at any depth */
+int lopt_plain(lval* v) {
+    lstack s = { NULL, 0, 0 };
+    int plain = 1;
+    for (; v && plain; v = lstack_pop(&s)) {
+        for (int i = 0; i < v->count && plain; i++) {
+            lval* x = v->cell[i];
+            switch (LTYPE(x)) {
+                case LVAL_FUN: plain = 0; break;
+                case LVAL_SEXPR:
+                case LVAL_QEXPR: lstack_push(&s, x); break;
+            }
         }
+    }
+    free(s.items);
+    return plain;
+}
 
-        lval* val = lval_pop(a, 0);
-        lenv_put(f->env, sym, val);
-        lval_del(sym); lval_del(val);
+/* the builtin a symbol in call position is sure to name, or NULL */
+lval* lopt_builtin(lopt* o, lval* k) {
+    if (LTYPE(k) != LVAL_SYM || k->sym->binds != 1
+            || lval_slot(o->formals, k->sym) != -1) {
+        return NULL;
     }
+    lval* f = lenv_peek(o->e, k);
+    if (!f || f != k->sym->global || LTYPE(f) != LVAL_FUN || !f->builtin) {
+        return NULL;
+    }
+    return f;
+}
 
-    lval_del(a);
+void lopt_dep(lopt* o, lval* k, lval* f) {
+    for (int i = 0; i < o->ndeps; i++) {
+        if (o->deps[i]->sym == k->sym) { return; }
+    }
+    o->deps = realloc(o->deps, sizeof(lval*) * (o->ndeps + 1));
+    o->vals = realloc(o->vals, sizeof(lval*) * (o->ndeps + 1));
+    o->deps[o->ndeps] = lval_sym(k->sym->name);
+    o->vals[o->ndeps++] = lval_ref(f);
+}
 
-    if (f->formals->count > 0 &&
-            strcmp(f->formals->cell[0]->sym, "&") == 0) {
-        if (f->formals->count != 2) {
-            return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+int lopt_const(lval* x) {
+    int t = LTYPE(x);
+    return t == LVAL_NUM || t == LVAL_STR || t == LVAL_QEXPR;
+}
+
+lval* lopt_sexpr(lopt* o, lval* v);
+lval* lopt_callee(lopt* o, lval* v);
+
+lval* lopt_expr(lopt* o, lval* x) {
+    return LTYPE(x) == LVAL_SEXPR ? lopt_sexpr(o, x) : NULL;
+}
+
+/* a body or branch, a list of code kept as a Q-expression */
+lval* lopt_code(lopt* o, lval* q) {
+    lval* x = lopt_sexpr(o, q);
+    if (!x) { return NULL; }
+    if (LTYPE(x) != LVAL_SEXPR) { return lval_add(lval_qexpr(), x); }
+    x->type = LVAL_QEXPR;
+    x->hash = 0;
+    return x;
+}
+
+/* what to compile in place of evaluating the elements of v, either a
+   constant or a new S-expression, NULL when v is as good as it gets.
+   Past the depth lcode_sexpr gives up at, nothing is folded at all */
+lval* lopt_sexpr(lopt* o, lval* v) {
+    if (o->depth > LVM_NEST) {
+        o->deep = 1;
+        return NULL;
+    }
+    o->depth++;
+
+    lval* f = v->count > 1 ? lopt_builtin(o, v->cell[0]) : NULL;
+    int branches = f && f->builtin->op == LB_IF && v->count == 4
+        && LTYPE(v->cell[2]) == LVAL_QEXPR
+        && LTYPE(v->cell[3]) == LVAL_QEXPR;
+
+    /* the elements, copied into y once one of them changes. Only one
+       branch runs, after the condition, ran is whether either could */
+    lval* y = NULL;
+    int constant = 1;
+    int cond = 0;
+    int taken = 0;
+    for (int i = 0; i < v->count; i++) {
+        if (branches && i == 2) { cond = o->ran; }
+        if (branches && i == 3) {
+            taken = o->ran;
+            o->ran = cond;
+        }
+        lval* x = branches && i > 1
+            ? lopt_code(o, v->cell[i]) : lopt_expr(o, v->cell[i]);
+        if (x && !y) {
+            y = lval_sexpr();
+            for (int j = 0; j < i; j++) { y = lval_add(y, lval_ref(v->cell[j])); }
         }
+        if (!x) { x = lval_ref(v->cell[i]); }
+        if (i > 0 && !lopt_const(x)) { constant = 0; }
+        if (y) { y = lval_add(y, x); } else { lval_del(x); }
+    }
 
-        lval_del(lval_pop(f->formals, 0));
+    /* whether the names may have been rebound by the time v is applied */
+    int ran = branches ? cond : o->ran;
+    if (branches) { o->ran |= taken; }
 
-        lval* sym = lval_pop(f->formals, 0);
-        lval* val = lval_qexpr();
-        lenv_put(f->env, sym, val);
-        lval_del(sym); lval_del(val);
+    lval* w = y ? y : v;
+    lval* x = NULL;
+    if (ran) {
+        /* past anything that may have rebound the builtins */
+    } else if (branches && LTYPE(w->cell[1]) == LVAL_NUM) {
+        lval* b = w->cell[LNUM(w->cell[1]) ? 2 : 3];
+        x = lval_sexpr();
+        for (int i = 0; i < b->count; i++) { x = lval_add(x, lval_ref(b->cell[i])); }
+    } else if (f && f->builtin->pure && constant) {
+        x = builtin_call(o->e, f->builtin, w->cell + 1, w->count - 1);
+        if (LTYPE(x) == LVAL_ERR) {
+            lval_del(x);
+            x = NULL;
+        }
+    }
+
+    /* a call to inline is copied so the compiler finds it in the tree */
+    lval* g = !x && !ran ? lopt_callee(o, w) : NULL;
+    if (g) {
+        if (!y) {
+            y = lval_sexpr();
+            for (int i = 0; i < v->count; i++) {
+                y = lval_add(y, lval_ref(v->cell[i]));
+            }
+        }
+        o->sites = realloc(o->sites, sizeof(lval*) * (o->nsites + 1));
+        o->callees = realloc(o->callees, sizeof(lval*) * (o->nsites + 1));
+        o->sites[o->nsites] = y;
+        o->callees[o->nsites++] = g;
     }
 
-    if (f->formals->count == 0) {
-        f->env->par = e;
-        return builtin_eval(f->env, lval_add(lval_sexpr(),
-                    lval_copy(f->body)));
+    /* folded branches are only code while the call is still an if */
+    if (x || (branches && y)) { lopt_dep(o, v->cell[0], f); }
+    if (!x && !g && v->count > 1 && !branches && !(f && f->builtin->pure)) {
+        o->ran = 1;
+    }
+    if (x) {
+        if (y) { lval_del(y); }
     } else {
-        return lval_copy(f);
+        x = y;
     }
+    o->depth--;
+    return x;
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
+/* whether the code v of g, a body or branch evaluated as an S-expression,
+   only applies pure builtins and if, which it depends on from then on */
+int lopt_leaf(lopt* o, lval* g, lval* v, int* size) {
+    *size -= v->count + 1;
+    if (*size < 0) { return 0; }
+
+    int leaf = 1;
+    if (v->count > 1) {
+        lval* k = v->cell[0];
+        lval* f = LTYPE(k) == LVAL_SYM && lval_slot(g->fun->formals, k->sym) == -1
+            ? lopt_builtin(o, k) : NULL;
+        int op = f ? f->builtin->op : -1;
+        if (op == LB_IF) {
+            leaf = k->sym == lsym_if && v->count == 4
+                && LTYPE(v->cell[2]) == LVAL_QEXPR
+                && LTYPE(v->cell[3]) == LVAL_QEXPR
+                && lopt_leaf(o, g, v->cell[2], size)
+                && lopt_leaf(o, g, v->cell[3], size);
+        } else {
+            leaf = f && f->builtin->pure;
+        }
+        if (leaf) { lopt_dep(o, k, f); }
+    }
+    for (int i = 1; i < v->count && leaf; i++) {
+        if (LTYPE(v->cell[i]) == LVAL_SEXPR) {
+            leaf = lopt_leaf(o, g, v->cell[i], size);
+        }
+    }
+    if (leaf && v->count == 1 && LTYPE(v->cell[0]) == LVAL_SEXPR) {
+        leaf = lopt_leaf(o, g, v->cell[0], size);
+    }
+    return leaf;
+}
 
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
+/* the lambda to compile in place of the call v, or NULL. It has to be
+   bound once, globally, take exactly the arguments given, capture
+   nothing and be a leaf of at most LCODE_INLINE nodes, so it can not
+   reach the caller again. Anything the callee was folded against has to
+   be current, not shadowed by a formal of the caller, and is depended on
+   as well */
+lval* lopt_callee(lopt* o, lval* v) {
+    if (v->count < 2 || LTYPE(v->cell[0]) != LVAL_SYM) { return NULL; }
+
+    lval* k = v->cell[0];
+    if (k->sym->binds != 1 || lval_slot(o->formals, k->sym) != -1) { return NULL; }
+    lval* g = lenv_peek(o->e, k);
+    if (!g || g != k->sym->global || LTYPE(g) != LVAL_FUN || g->builtin) {
+        return NULL;
+    }
+    lcode* d = g->fun->code;
+    if (g->fun->args || g->fun->env->count || !d || d->variadic
+            || d->arity != v->count - 1 || !lopt_plain(g->fun->body)) {
+        return NULL;
     }
 
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+    for (int i = 0; i < d->ndeps; i++) {
+        if (lenv_peek(o->e, d->deps[i]) != d->vals[i]
+                || lval_slot(o->formals, d->deps[i]->sym) != -1) {
+            return NULL;
+        }
+    }
+
+    int size = LCODE_INLINE;
+    if (!lopt_leaf(o, g, d->body ? d->body : g->fun->body, &size)) { return NULL; }
+
+    lopt_dep(o, k, g);
+    for (int i = 0; i < d->ndeps; i++) { lopt_dep(o, d->deps[i], d->vals[i]); }
+    return g;
+}
+
+/* the lambda the optimizer chose to inline at the call v, or NULL */
+lval* lcode_callee(lcode* c, lval* v) {
+    lopt* o = c->opt;
+    if (!o || c->inlined) { return NULL; }
+    for (int i = 0; i < o->nsites; i++) {
+        if (o->sites[i] == v) { return o->callees[i]; }
+    }
+    return NULL;
+}
+
+/* compiles body, folded against the bindings in e unless e is NULL */
+lcode* lcode_new(lenv* e, lval* formals, lval* body) {
+    int variadic = 0;
+    for (int i = 0; i < formals->count; i++) {
+        if (formals->cell[i]->sym == lsym_amp) { variadic = 1; }
+        for (int j = 0; j < i; j++) {
+            if (formals->cell[j]->sym == formals->cell[i]->sym) { return NULL; }
+        }
+    }
+
+    lcode* c = malloc(sizeof(lcode));
+    c->ops = NULL;
+    c->count = 0;
+    c->consts = NULL;
+    c->nconsts = 0;
+    c->arity = formals->count;
+    c->variadic = variadic;
+    c->depth = 0;
+    c->sp = 0;
+    c->nest = 0;
+    c->rc = 1;
+    c->calls = 0;
+    c->jit = NULL;
+    c->body = NULL;
+    c->deps = NULL;
+    c->vals = NULL;
+    c->ndeps = 0;
+    c->opt = NULL;
+    c->inlined = NULL;
+    c->argbase = 0;
+
+    lopt o = { e, formals, NULL, NULL, 0, 0, 0, 0, NULL, NULL, 0 };
+    int on = arena.on;
+    arena.on = 0;
+    if (e && lopt_on && lopt_plain(body)) {
+        /* optimized code never points into the nursery, see lcode_moved */
+        c->body = lopt_code(&o, body);
+        if (!c->body && body->arena) { c->body = lval_copy(body); }
+        c->opt = &o;
     }
+    if (!o.deep) { lcode_sexpr(c, c->body ? c->body : body, 1); }
+    arena.on = on;
+    c->opt = NULL;
+    free(o.sites);
+    free(o.callees);
+    c->deps = o.deps;
+    c->vals = o.vals;
+    c->ndeps = o.ndeps;
+
+    if (o.deep) {
+        lcode_del(c);
+        return lcode_new(NULL, formals, body);
+    }
+    if (c->nest) {
+        lcode_del(c);
+        return NULL;
+    }
+    return c;
+}
+
+/* the code for a function whose body has moved out of the nursery, an
+   optimized one has a tree of its own */
+lcode* lcode_moved(lcode* c, lval* formals, lval* body) {
+    if (c->body) { return c; }
+    lcode_del(c);
+    return lcode_new(NULL, formals, body);
+}
+
+/* the code to run f with when called from e, compiled again if a name it
+   folded a builtin for is no longer bound to it. Frames still running the
+   old code hold references to it, so it goes when the last one returns.
+   Only a body nested about as deep as LVM_NEST can fail to compile again,
+   it keeps what it has */
+lcode* lval_code(lenv* e, lval* f) {
+    lcode* c = f->fun->code;
+    if (!c) { return NULL; }
+    for (int i = 0; i < c->ndeps; i++) {
+        if (lenv_peek(e, c->deps[i]) == c->vals[i]) { continue; }
+        lcode* n = lcode_new(e, f->fun->formals, f->fun->body);
+        if (!n) { break; }
+        lcode_del(c);
+        f->fun->code = n;
+        if (lgc_marking) { lcode_each(n, lgc_shade); }
+        return n;
+    }
+    return c;
+}
 
-    if (v->count == 0) { return v; }
+/* arithmetic and comparison on two small integers need no argument list,
+   NULL leaves the call to the builtin */
+lval* lvm_binop(const lbdesc* d, lval* x, lval* y) {
+    if (d->op == LB_EQ) { return lval_num(lval_eq(x, y)); }
+    if (d->op == LB_NE) { return lval_num(!lval_eq(x, y)); }
+    if (!LVAL_IS_INT(x) || !LVAL_IS_INT(y)) { return NULL; }
+
+    long a = LNUM(x);
+    long b = LNUM(y);
+    switch (d->op) {
+        case LB_ADD: return lval_num(a + b);
+        case LB_SUB: return lval_num(a - b);
+        case LB_MUL: return lnum_op(LB_MUL, a, b, &a) ? lval_num(a) : NULL;
+        case LB_DIV: return b != 0 ? lval_num(a / b) : NULL;
+        case LB_GT:  return lval_num(a > b);
+        case LB_LT:  return lval_num(a < b);
+        case LB_GE:  return lval_num(a >= b);
+        case LB_LE:  return lval_num(a <= b);
+    }
+    return NULL;
+}
+
+/* JIT */
+
+/* a lambda over small integers that only uses its formals, literals,
+   arithmetic, comparisons, if and calls to itself is compiled to x86-64
+   after LJIT_THRESHOLD calls. Whatever the machine code cannot finish
+   unwinds to the entry, and the VM runs the call from the start */
+#ifdef LJIT
+
+#define LJIT_THRESHOLD 100
+#define LJIT_DEPTH 4096
+#define LJIT_ARGS 6
+#define LJIT_SELF -1
+
+struct ljit {
+    unsigned char* mem;
+    size_t size;
+    lval** syms;
+    int* ops;
+    int nguards;
+};
+
+typedef struct ljit_gen {
+    unsigned char* buf;
+    int len;
+    int max;
+    int bail;
+    int body;
+    int loop;
+    lval* formals;
+    lcode* code;
+    ljit* jit;
+} ljit_gen;
+
+/* the calls the machine code may still make, and its stack pointer on
+   entry to unwind to */
+long ljit_budget;
+void* ljit_rsp;
+
+/* rdi, rsi, rdx, rcx, r8, r9 */
+int ljit_regs[LJIT_ARGS] = { 7, 6, 2, 1, 8, 9 };
+
+void ljit_byte(ljit_gen* g, int b) {
+    if (g->len == g->max) {
+        g->max = g->max ? g->max * 2 : 256;
+        g->buf = realloc(g->buf, g->max);
+    }
+    g->buf[g->len++] = b;
+}
 
-    if (v->count == 1 ) { return lval_take(v, 0); }
+void ljit_code(ljit_gen* g, int n, ...) {
+    va_list va;
+    va_start(va, n);
+    for (int i = 0; i < n; i++) { ljit_byte(g, va_arg(va, int)); }
+    va_end(va);
+}
+
+void ljit_imm(ljit_gen* g, long x, int n) {
+    for (int i = 0; i < n; i++) { ljit_byte(g, (x >> (8 * i)) & 0xFF); }
+}
+
+/* a rel32 to target, or a hole to patch when target is -1 */
+int ljit_rel(ljit_gen* g, int target) {
+    int at = g->len;
+    ljit_imm(g, target == -1 ? 0 : target - (at + 4), 4);
+    return at;
+}
+
+void ljit_patch(ljit_gen* g, int at) {
+    long rel = g->len - (at + 4);
+    for (int i = 0; i < 4; i++) { g->buf[at + i] = (rel >> (8 * i)) & 0xFF; }
+}
+
+/* mov r11, &x */
+void ljit_addr(ljit_gen* g, void* x) {
+    ljit_code(g, 2, 0x49, 0xBB);
+    ljit_imm(g, (long)(intptr_t)x, 8);
+}
+
+/* jo bail */
+void ljit_overflow(ljit_gen* g) {
+    ljit_code(g, 2, 0x0F, 0x80);
+    ljit_rel(g, g->bail);
+}
+
+/* rax must stay a small integer: mov rcx, rax; add rcx, rcx; jo bail */
+void ljit_range(ljit_gen* g) {
+    ljit_code(g, 6, 0x48, 0x89, 0xC1, 0x48, 0x01, 0xC9);
+    ljit_overflow(g);
+}
+
+/* mov [rbp - 8 - 8i], reg or the other way round */
+void ljit_slot(ljit_gen* g, int i, int reg, int load) {
+    ljit_code(g, 3, 0x48 | (reg >= 8 ? 4 : 0), load ? 0x8B : 0x89,
+              0x85 | ((reg & 7) << 3));
+    ljit_imm(g, -8 - 8 * i, 4);
+}
+
+void ljit_pop(ljit_gen* g, int reg) {
+    if (reg >= 8) { ljit_byte(g, 0x41); }
+    ljit_byte(g, 0x58 + (reg & 7));
+}
+
+/* the builtin op or LJIT_SELF the symbol in call position names, guarded
+   from then on, -2 when it is neither */
+int ljit_guard(ljit_gen* g, lenv* e, lval* k) {
+    if (lval_slot(g->formals, k->sym) != -1) { return -2; }
+
+    lval* f = lenv_peek(e, k);
+    int op = -2;
+    if (!f || LTYPE(f) != LVAL_FUN) { return op; }
+    if (f->builtin) {
+        op = f->builtin->op;
+    } else if (f->fun->code == g->code && !f->fun->args && f->fun->env->count == 0) {
+        op = LJIT_SELF;
+    }
+    if (op == -2) { return op; }
+
+    ljit* j = g->jit;
+    for (int i = 0; i < j->nguards; i++) {
+        if (j->syms[i]->sym == k->sym) { return op; }
+    }
+    j->syms = realloc(j->syms, sizeof(lval*) * (j->nguards + 1));
+    j->ops = realloc(j->ops, sizeof(int) * (j->nguards + 1));
+    j->syms[j->nguards] = k;
+    j->ops[j->nguards++] = op;
+    return op;
+}
+
+int ljit_sexpr(ljit_gen* g, lenv* e, lval** v, int n, int tail);
+
+/* the value of x in rax */
+int ljit_expr(ljit_gen* g, lenv* e, lval* x, int tail) {
+    switch (LTYPE(x)) {
+        case LVAL_NUM:
+            if (!LVAL_IS_INT(x)) { return 0; }
+            ljit_code(g, 2, 0x48, 0xB8);
+            ljit_imm(g, LNUM(x), 8);
+            return 1;
+        case LVAL_SYM: {
+            int i = lval_slot(g->formals, x->sym);
+            if (i == -1) { return 0; }
+            ljit_slot(g, i, 0, 1);
+            return 1;
+        }
+        case LVAL_SEXPR:
+            return ljit_sexpr(g, e, x->cell, x->count, tail);
+    }
+    return 0;
+}
+
+/* the value of the S-expression v[0..n) in rax */
+int ljit_sexpr(ljit_gen* g, lenv* e, lval** v, int n, int tail) {
+    if (n == 0) { return 0; }
+    if (n == 1) { return ljit_expr(g, e, v[0], tail); }
+    if (LTYPE(v[0]) != LVAL_SYM) { return 0; }
+
+    int op = ljit_guard(g, e, v[0]);
+    switch (op) {
+        case LB_IF: {
+            if (n != 4 || LTYPE(v[2]) != LVAL_QEXPR || LTYPE(v[3]) != LVAL_QEXPR) {
+                return 0;
+            }
+            if (!ljit_expr(g, e, v[1], 0)) { return 0; }
+            /* test rax, rax; jz else */
+            ljit_code(g, 5, 0x48, 0x85, 0xC0, 0x0F, 0x84);
+            int other = ljit_rel(g, -1);
+            if (!ljit_sexpr(g, e, v[2]->cell, v[2]->count, tail)) { return 0; }
+            ljit_byte(g, 0xE9);
+            int end = ljit_rel(g, -1);
+            ljit_patch(g, other);
+            if (!ljit_sexpr(g, e, v[3]->cell, v[3]->count, tail)) { return 0; }
+            ljit_patch(g, end);
+            return 1;
+        }
+        case LB_ADD: case LB_SUB: case LB_MUL: case LB_DIV:
+            if (!ljit_expr(g, e, v[1], 0)) { return 0; }
+            if (n == 2 && op == LB_SUB) {
+                /* neg rax */
+                ljit_code(g, 3, 0x48, 0xF7, 0xD8);
+                ljit_range(g);
+            }
+            for (int i = 2; i < n; i++) {
+                /* push rax; ..; mov rcx, rax; pop rax */
+                ljit_byte(g, 0x50);
+                if (!ljit_expr(g, e, v[i], 0)) { return 0; }
+                ljit_code(g, 4, 0x48, 0x89, 0xC1, 0x58);
+                switch (op) {
+                    case LB_ADD: ljit_code(g, 3, 0x48, 0x01, 0xC8); break;
+                    case LB_SUB: ljit_code(g, 3, 0x48, 0x29, 0xC8); break;
+                    case LB_MUL: ljit_code(g, 4, 0x48, 0x0F, 0xAF, 0xC1); break;
+                    case LB_DIV:
+                        /* test rcx, rcx; jz bail; cqo; idiv rcx */
+                        ljit_code(g, 5, 0x48, 0x85, 0xC9, 0x0F, 0x84);
+                        ljit_rel(g, g->bail);
+                        ljit_code(g, 5, 0x48, 0x99, 0x48, 0xF7, 0xF9);
+                        break;
+                }
+                if (op != LB_DIV) { ljit_overflow(g); }
+                ljit_range(g);
+            }
+            return 1;
+        case LB_GT: case LB_LT: case LB_GE: case LB_LE: case LB_EQ: case LB_NE: {
+            if (n != 3) { return 0; }
+            if (!ljit_expr(g, e, v[1], 0)) { return 0; }
+            ljit_byte(g, 0x50);
+            if (!ljit_expr(g, e, v[2], 0)) { return 0; }
+            /* mov rcx, rax; pop rax; cmp rax, rcx; setcc al; movzx eax, al */
+            int cc = op == LB_GT ? 0x9F : op == LB_LT ? 0x9C : op == LB_GE ? 0x9D
+                   : op == LB_LE ? 0x9E : op == LB_EQ ? 0x94 : 0x95;
+            ljit_code(g, 13, 0x48, 0x89, 0xC1, 0x58, 0x48, 0x39, 0xC8,
+                      0x0F, cc, 0xC0, 0x0F, 0xB6, 0xC0);
+            return 1;
+        }
+        case LJIT_SELF: {
+            int k = g->formals->count;
+            if (n - 1 != k) { return 0; }
+            for (int i = 1; i < n; i++) {
+                if (!ljit_expr(g, e, v[i], 0)) { return 0; }
+                ljit_byte(g, 0x50);
+            }
+            if (tail) {
+                /* rebind the formals and go round again */
+                for (int i = k - 1; i >= 0; i--) {
+                    ljit_pop(g, 0);
+                    ljit_slot(g, i, 0, 0);
+                }
+                ljit_byte(g, 0xE9);
+                ljit_rel(g, g->loop);
+            } else {
+                for (int i = k - 1; i >= 0; i--) { ljit_pop(g, ljit_regs[i]); }
+                ljit_byte(g, 0xE8);
+                ljit_rel(g, g->body);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+ljit* ljit_compile(lenv* e, lval* f) {
+    int k = f->fun->formals->count;
+    if (k > LJIT_ARGS) { return NULL; }
+
+    ljit* j = malloc(sizeof(ljit));
+    j->mem = NULL;
+    j->size = 0;
+    j->syms = NULL;
+    j->ops = NULL;
+    j->nguards = 0;
+
+    ljit_gen g = { NULL, 0, 0, 0, 0, 0, f->fun->formals, f->fun->code, j };
+
+    /* int entry(long* args, long* out), args in rdi, out in rsi:
+       push rbp; mov rbp, rsp; push rsi; sub rsp, 8; mov [&ljit_rsp], rsp */
+    ljit_code(&g, 9, 0x55, 0x48, 0x89, 0xE5, 0x56, 0x48, 0x83, 0xEC, 0x08);
+    ljit_addr(&g, &ljit_rsp);
+    ljit_code(&g, 3, 0x49, 0x89, 0x23);
+    /* mov rax, rdi; then each argument register from [rax + 8i] */
+    ljit_code(&g, 3, 0x48, 0x89, 0xF8);
+    for (int i = 0; i < k; i++) {
+        int r = ljit_regs[i];
+        ljit_code(&g, 4, 0x48 | (r >= 8 ? 4 : 0), 0x8B, 0x40 | ((r & 7) << 3), 8 * i);
+    }
+    ljit_byte(&g, 0xE8);
+    int call = ljit_rel(&g, -1);
+    /* mov rcx, [rbp - 8]; mov [rcx], rax; mov eax, 1; leave; ret */
+    ljit_code(&g, 14, 0x48, 0x8B, 0x4D, 0xF8, 0x48, 0x89, 0x01,
+              0xB8, 0x01, 0x00, 0x00, 0x00, 0xC9, 0xC3);
+
+    /* bail: mov rsp, [&ljit_rsp]; add rsp, 16; pop rbp; xor eax, eax; ret */
+    g.bail = g.len;
+    ljit_addr(&g, &ljit_rsp);
+    ljit_code(&g, 11, 0x49, 0x8B, 0x23, 0x48, 0x83, 0xC4, 0x10, 0x5D, 0x31, 0xC0, 0xC3);
+
+    /* body: push rbp; mov rbp, rsp; sub rsp, 8k; store the arguments */
+    g.body = g.len;
+    ljit_patch(&g, call);
+    ljit_code(&g, 7, 0x55, 0x48, 0x89, 0xE5, 0x48, 0x81, 0xEC);
+    ljit_imm(&g, 8 * k, 4);
+    for (int i = 0; i < k; i++) { ljit_slot(&g, i, ljit_regs[i], 0); }
+    /* sub qword [&ljit_budget], 1; js bail */
+    ljit_addr(&g, &ljit_budget);
+    ljit_code(&g, 6, 0x49, 0x83, 0x2B, 0x01, 0x0F, 0x88);
+    ljit_rel(&g, g.bail);
+
+    g.loop = g.len;
+    int ok = ljit_sexpr(&g, e, f->fun->body->cell, f->fun->body->count, 1);
+
+    /* add qword [&ljit_budget], 1; leave; ret */
+    ljit_addr(&g, &ljit_budget);
+    ljit_code(&g, 6, 0x49, 0x83, 0x03, 0x01, 0xC9, 0xC3);
+
+    if (ok) {
+        j->mem = mmap(NULL, g.len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (j->mem == MAP_FAILED) {
+            j->mem = NULL;
+        } else {
+            memcpy(j->mem, g.buf, g.len);
+            /* where executable mappings are refused the VM runs it */
+            if (mprotect(j->mem, g.len, PROT_READ | PROT_EXEC) != 0) {
+                munmap(j->mem, g.len);
+                j->mem = NULL;
+            } else {
+                j->size = g.len;
+            }
+        }
+    }
+    free(g.buf);
+
+    if (!j->mem) {
+        ljit_del(j);
+        return NULL;
+    }
+    return j;
+}
+
+void ljit_del(ljit* j) {
+    if (!j) { return; }
+    if (j->mem) { munmap(j->mem, j->size); }
+    free(j->syms);
+    free(j->ops);
+    free(j);
+}
+
+/* runs a direct call of f natively, 0 leaves it to the VM */
+int ljit_call(lenv* e, lval* f, lval** args, int n, lval** out) {
+    lcode* c = f->fun->code;
+    if (f->fun->args) { return 0; }
+    if (!c->jit) {
+        if (++c->calls != LJIT_THRESHOLD) { return 0; }
+        c->jit = ljit_compile(e, f);
+        if (!c->jit) { return 0; }
+    }
+
+    long in[LJIT_ARGS];
+    for (int i = 0; i < n; i++) {
+        if (!LVAL_IS_INT(args[i])) { return 0; }
+        in[i] = LNUM(args[i]);
+    }
+
+    ljit* j = c->jit;
+    for (int i = 0; i < j->nguards; i++) {
+        lval* g = lenv_peek(e, j->syms[i]);
+        int ok = g && LTYPE(g) == LVAL_FUN && (j->ops[i] == LJIT_SELF
+            ? !g->builtin && g->fun->code == c && !g->fun->args
+              && g->fun->env->count == 0
+            : g->builtin && g->builtin->op == j->ops[i]);
+        if (!ok) { return 0; }
+    }
+
+    ljit_budget = vm.limit - vm.depth < LJIT_DEPTH ? vm.limit - vm.depth : LJIT_DEPTH;
+    long x;
+    if (!((int (*)(long*, long*))j->mem)(in, &x)) { return 0; }
+    *out = lval_num(x);
+    return 1;
+}
+
+#else
+
+void ljit_del(ljit* j) {}
+
+int ljit_call(lenv* e, lval* f, lval** args, int n, lval** out) { return 0; }
+
+#endif
+
+/* (op sym num) with the three elements in k, read where they are bound
+   in e, NULL when lvm_binop cannot do it */
+lval* lvm_opsn(lenv* e, lval** k) {
+    lval* f = lenv_peek(e, k[0]);
+    if (!f || LTYPE(f) != LVAL_FUN || !f->builtin) { return NULL; }
+    lval* y = lenv_peek(e, k[1]);
+    return y ? lvm_binop(f->builtin, y, k[2]) : NULL;
+}
 
-    lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
+/* a pure builtin applied to symbols and literals only, the elements in
+   v, called on the values as they are bound. NULL when v is not that */
+lval* lvm_borrow(lenv* e, lval** v, int n) {
+    lval* f = lenv_peek(e, v[0]);
+    if (!f || LTYPE(f) != LVAL_FUN || !f->builtin || !f->builtin->pure) {
+        return NULL;
+    }
+
+    lvm_reserve(n);
+    lval** args = vm.stack + vm.sp;
+    for (int i = 1; i < n; i++) {
+        lval* x = v[i];
+        if (LTYPE(x) == LVAL_SEXPR) { return NULL; }
+        if (LTYPE(x) == LVAL_SYM && !(x = lenv_peek(e, x))) { return NULL; }
+        if (LTYPE(x) == LVAL_ERR) { return NULL; }
+        args[i - 1] = x;
+    }
+    return builtin_call(e, f->builtin, args, n - 1);
+}
+
+lval* lvm_run(lenv* e, lcode* c, int own);
+lval* lval_call(lenv* e, lval* f, lval* a);
+
+/* a compiled lambda, or a partial application of one, called from e with
+   exactly the formals it still takes */
+int lvm_direct(lenv* e, lval* f, int n) {
+    return !f->builtin && f->fun->code && (!f->fun->code->ndeps || lval_code(e, f))
+        && !f->fun->code->variadic && f->fun->code->arity == lval_bound(f) + n
+        && f->fun->env->count == 0;
+}
+
+/* a frame binding the arguments f was partially applied to followed by
+   the n in args, which it takes */
+lenv* lvm_bind(lval* f, lval** args, int n) {
+    lenv* frame = lenv_new();
+    int bound = lval_bound(f);
+    if (bound) {
+        for (int i = 0; i < bound; i++) { lval_ref(f->fun->args->cell[i]); }
+        lenv_bind(frame, f->fun->formals->cell, f->fun->args->cell, bound);
+    }
+    lenv_bind(frame, f->fun->formals->cell + bound, args, n);
+    return frame;
+}
+
+/* runs f on a frame bound straight from the arguments, which it takes */
+lval* lvm_invoke(lenv* e, lval* f, lval** args, int n) {
+    lenv* frame = lvm_bind(f, args, n);
+    frame->par = e;
+    return lvm_run(frame, f->fun->code, 1);
+}
+
+/* with dynamic scope a tail call can only drop the caller's frame when
+   the callee rebinds every name in it */
+int lvm_shadows(lval* formals, lenv* e) {
+    for (int i = 0; i < e->count; i++) {
+        if (lval_slot(formals, e->syms[i]) == -1) { return 0; }
+    }
+    return 1;
+}
+
+int lvm_same(lval* formals, lenv* e) {
+    if (formals->count != e->count) { return 0; }
+    for (int i = 0; i < e->count; i++) {
+        if (formals->cell[i]->sym != e->syms[i]) { return 0; }
+    }
+    return 1;
+}
+
+/* the evaluated elements of an S-expression, as lval_eval_sexpr. The
+   arguments are read before anything can run, which may move vm.stack */
+lval* lvm_call(lenv* e, lval** v, int n) {
+    for (int i = 0; i < n; i++) {
+        if (LTYPE(v[i]) != LVAL_ERR) { continue; }
+        for (int j = 0; j < n; j++) {
+            if (j != i) { lval_del(v[j]); }
+        }
+        return v[i];
+    }
+
+    /* a single element is its value, unless it is a builtin taking no
+       arguments, which is called */
+    if (n == 0) { return lval_sexpr(); }
+    lval* f = v[0];
+    if (n == 1 && !(LTYPE(f) == LVAL_FUN && f->builtin && f->builtin->max == 0)) {
+        return f;
+    }
+
+    if (LTYPE(f) != LVAL_FUN) {
         lval* err = lval_err(
-        ltype_name(f->type), ltype_name(LVAL_FUN));
-        lval_del(f); lval_del(v);
+        ltype_name(LTYPE(f)), ltype_name(LVAL_FUN));
+        for (int i = 0; i < n; i++) { lval_del(v[i]); }
         return err;
     }
 
-    /* call builtin with operator */
-    lval* result = lval_call(e, f, v);
+    lval* x = NULL;
+    if (f->builtin && n == 3) {
+        x = lvm_binop(f->builtin, v[1], v[2]);
+        if (x) { lval_del(v[1]); lval_del(v[2]); }
+    }
+
+    /* a builtin borrows its arguments, from a copy of the pointers since
+       whatever it evaluates may move vm.stack */
+    if (!x && f->builtin) {
+        lval* args[n > 1 ? n - 1 : 1];
+        memcpy(args, v + 1, sizeof(lval*) * (n - 1));
+        x = builtin_call(e, f->builtin, args, n - 1);
+        for (int i = 0; i < n - 1; i++) { lval_del(args[i]); }
+    }
+
+    if (!x) {
+        lval* a = lval_sexpr();
+        for (int i = 1; i < n; i++) { a = lval_add(a, v[i]); }
+        x = lval_call(e, f, a);
+    }
     lval_del(f);
-    return result;
+    return x;
 }
 
-lval* lval_eval(lenv* e,lval* v) {
-    /* evaluate Sexpressions */
-    if (v->type == LVAL_SYM) {
-        lval* x = lenv_get(e, v);
-        lval_del(v);
+/* a call the loop can enter itself, none of the elements being an error */
+int lvm_ready(lenv* e, lval** v, int n) {
+    if (n < 2 || LTYPE(v[0]) != LVAL_FUN || !lvm_direct(e, v[0], n - 1)) { return 0; }
+    for (int i = 1; i < n; i++) {
+        if (LTYPE(v[i]) == LVAL_ERR) { return 0; }
+    }
+    return 1;
+}
+
+/* own counts the frames on top of the scope chain that belong to the
+   running call, tail calls add to them when they cannot replace one.
+   Each call in progress below it is saved in vm.frames, base is where
+   its operands start on vm.stack. The loop keeps the top in sp and
+   stores it to vm.sp around anything that may run code, which may also
+   move vm.stack */
+lval* lvm_run(lenv* e, lcode* c, int own) {
+    lval* err = lvm_nest_err();
+    if (err) {
+        while (own--) {
+            lenv* par = e->par;
+            lenv_del(e);
+            e = par;
+        }
+        return err;
+    }
+    vm.nest++;
+
+    int entry = vm.depth;
+    int base = vm.sp;
+    int* op = c->ops;
+    lcode_ref(c);
+    lval* fn = NULL;
+    lval* x;
+    lvm_reserve(c->depth);
+    lval** sp = vm.stack + vm.sp;
+    int n, tail;
+
+#ifdef LVM_THREADED
+    static void* labels[] = {
+        [LOP_CONST] = &&LOP_CONST_L, [LOP_SYM] = &&LOP_SYM_L,
+        [LOP_CALL] = &&LOP_CALL_L, [LOP_TAIL] = &&LOP_TAIL_L,
+        [LOP_IF] = &&LOP_IF_L, [LOP_JUMP] = &&LOP_JUMP_L,
+        [LOP_RETURN] = &&LOP_RETURN_L, [LOP_OPSN] = &&LOP_OPSN_L,
+        [LOP_IFOPSN] = &&LOP_IFOPSN_L, [LOP_BORROW] = &&LOP_BORROW_L,
+        [LOP_ARG] = &&LOP_ARG_L, [LOP_ENTER] = &&LOP_ENTER_L,
+        [LOP_DROP] = &&LOP_DROP_L
+    };
+#define LVM_DISPATCH goto *labels[*op++];
+#define LVM_OP(name) name##_L
+#define LVM_NEXT goto *labels[*op++]
+#else
+#define LVM_DISPATCH switch (*op++)
+#define LVM_OP(name) case name
+#define LVM_NEXT break
+#endif
+
+    for (;;) {
+        LVM_DISPATCH {
+            LVM_OP(LOP_CONST):
+                *sp++ = lval_ref(c->consts[*op++]);
+                LVM_NEXT;
+            LVM_OP(LOP_SYM):
+                *sp++ = lenv_lookup(e, c->consts[*op++]);
+                LVM_NEXT;
+            LVM_OP(LOP_ARG):
+                *sp++ = lval_ref(vm.stack[base + *op++]);
+                LVM_NEXT;
+            LVM_OP(LOP_ENTER): {
+                /* an inlined call, whose first error is its value */
+                n = op[0];
+                lval** v = sp - n;
+                x = NULL;
+                for (int i = 0; i < n && !x; i++) {
+                    if (LTYPE(v[i]) == LVAL_ERR) { x = v[i]; }
+                }
+                if (!x) {
+                    op += 2;
+                    LVM_NEXT;
+                }
+                for (int i = 0; i < n; i++) {
+                    if (v[i] != x) { lval_del(v[i]); }
+                }
+                sp = v;
+                *sp++ = x;
+                op = c->ops + op[1];
+                LVM_NEXT;
+            }
+            LVM_OP(LOP_DROP):
+                n = *op++;
+                x = *--sp;
+                while (n--) { lval_del(*--sp); }
+                *sp++ = x;
+                LVM_NEXT;
+            LVM_OP(LOP_OPSN):
+                x = lvm_opsn(e, c->consts + op[0]);
+                if (!x) {
+                    op += 3;
+                    LVM_NEXT;
+                }
+                if (op[1]) { goto ret; }
+                *sp++ = x;
+                op = c->ops + op[2];
+                LVM_NEXT;
+            LVM_OP(LOP_BORROW):
+                vm.sp = sp - vm.stack;
+                x = lvm_borrow(e, c->consts + op[0], op[1]);
+                sp = vm.stack + vm.sp;
+                if (!x) {
+                    op += 4;
+                    LVM_NEXT;
+                }
+                if (op[2]) { goto ret; }
+                *sp++ = x;
+                op = c->ops + op[3];
+                LVM_NEXT;
+            LVM_OP(LOP_IFOPSN): {
+                lval* f = lenv_peek(e, c->consts[op[0]]);
+                x = NULL;
+                if (f && LTYPE(f) == LVAL_FUN && f->builtin && f->builtin->op == LB_IF) {
+                    x = lvm_opsn(e, c->consts + op[1]);
+                }
+                if (!x) {
+                    op += 4;
+                    LVM_NEXT;
+                }
+                op = c->ops + op[LNUM(x) ? 2 : 3];
+                lval_del(x);
+                LVM_NEXT;
+            }
+            LVM_OP(LOP_CALL):
+            LVM_OP(LOP_TAIL): {
+                tail = op[-1] == LOP_TAIL;
+                n = *op++;
+                lval** v = sp -= n;
+                if (!lvm_ready(e, v, n)) {
+                    vm.sp = sp - vm.stack;
+                    x = lvm_call(e, v, n);
+                    if (tail) { goto ret; }
+                    sp = vm.stack + vm.sp;
+                    *sp++ = x;
+                    LVM_NEXT;
+                }
+
+                lval* f = v[0];
+                if (ljit_call(e, f, v + 1, n - 1, &x)) {
+                    for (int i = 0; i < n; i++) { lval_del(v[i]); }
+                    if (tail) { goto ret; }
+                    *sp++ = x;
+                    LVM_NEXT;
+                }
+
+                if (!tail) {
+                    if (vm.depth >= vm.limit) {
+                        for (int i = 0; i < n; i++) { lval_del(v[i]); }
+                        *sp++ = lval_err("Maximum call depth %li exceeded", vm.limit);
+                        LVM_NEXT;
+                    }
+
+                    /* save the caller and enter f on a frame of its own */
+                    lvm_frame* r = lvm_frame_push();
+                    r->code = c;
+                    r->op = op;
+                    r->env = e;
+                    r->fn = fn;
+                    r->own = own;
+                    r->base = base;
+
+                    lenv* frame = lvm_bind(f, v + 1, n - 1);
+                    frame->par = e;
+                    e = frame;
+                    own = 1;
+                    fn = f;
+                    base = sp - vm.stack;
+                } else {
+                    if (own && !f->fun->args && lvm_same(f->fun->formals, e)) {
+                        /* a loop rebinds its own frame */
+                        for (int i = 0; i < e->count; i++) {
+                            lval_del(e->vals[i]);
+                            e->vals[i] = lval_keep(e->arena, v[1 + i]);
+                        }
+                    } else {
+                        lenv* frame = lvm_bind(f, v + 1, n - 1);
+                        if (lvm_shadows(f->fun->formals, e)) {
+                            frame->par = e->par;
+                            if (own) { lenv_del(e); } else { own = 1; }
+                        } else {
+                            frame->par = e;
+                            own++;
+                        }
+                        e = frame;
+                    }
+
+                    if (fn) { lval_del(fn); }
+                    fn = f;
+                    lcode_del(c);
+                }
+
+                c = lcode_ref(f->fun->code);
+                op = c->ops;
+                vm.sp = sp - vm.stack;
+                lvm_reserve(c->depth);
+                sp = vm.stack + vm.sp;
+                LVM_NEXT;
+            }
+            LVM_OP(LOP_IF): {
+                lval* f = sp[-2];
+                lval* x = sp[-1];
+                if (LTYPE(f) == LVAL_FUN && f->builtin && f->builtin->op == LB_IF
+                        && LTYPE(x) == LVAL_NUM) {
+                    sp -= 2;
+                    op = LNUM(x) ? op + 4 : c->ops + op[2];
+                    lval_del(f);
+                    lval_del(x);
+                } else {
+                    *sp++ = lval_ref(c->consts[op[0]]);
+                    *sp++ = lval_ref(c->consts[op[1]]);
+                    sp -= 4;
+                    vm.sp = sp - vm.stack;
+                    x = lvm_call(e, sp, 4);
+                    sp = vm.stack + vm.sp;
+                    *sp++ = x;
+                    op = c->ops + op[3];
+                }
+                LVM_NEXT;
+            }
+            LVM_OP(LOP_JUMP):
+                op = c->ops + *op;
+                LVM_NEXT;
+            LVM_OP(LOP_RETURN):
+                x = *--sp;
+                goto ret;
+        }
+        continue;
+
+    ret:
+        while (own--) {
+            lenv* par = e->par;
+            lenv_del(e);
+            e = par;
+        }
+        if (fn) { lval_del(fn); }
+        lcode_del(c);
+        vm.sp = base;
+        if (vm.depth == entry) { break; }
+
+        /* back in the caller, with the result as the value of its call */
+        lvm_frame* r = &vm.frames[--vm.depth];
+        c = r->code;
+        op = r->op;
+        e = r->env;
+        fn = r->fn;
+        own = r->own;
+        base = r->base;
+        sp = vm.stack + vm.sp;
+        *sp++ = x;
+    }
+
+    vm.nest--;
+    return x;
+}
+
+#undef LVM_DISPATCH
+#undef LVM_OP
+#undef LVM_NEXT
+
+lval* builtin_max_depth(lenv* e, lval** argv, int argc) {
+    LASSERT_ARGV(LNUM(argv[0]) > 0,
+            "Function 'max-depth' passed a depth below one.");
+
+    long old = vm.limit;
+    vm.limit = LNUM(argv[0]);
+
+    return lval_num(old);
+}
+
+/* each level of nesting takes C stack, past what the stack holds runs
+   fail as they do past the limit, so a limit much above the default
+   also needs a larger stack (ulimit -s) to be reached */
+lval* builtin_max_nest(lenv* e, lval** argv, int argc) {
+    LASSERT_ARGV(LNUM(argv[0]) > 0 && LNUM(argv[0]) <= INT_MAX,
+            "Function 'max-nest' passed a depth out of range.");
+
+    long old = vm.nest_limit;
+    vm.nest_limit = LNUM(argv[0]);
+
+    return lval_num(old);
+}
+
+lval* lval_call(lenv* e, lval* f, lval* a) {
+    if (f->builtin) {
+        lval* x = builtin_call(e, f->builtin, a->cell, a->count);
+        lval_del(a);
         return x;
     }
-    if (v->type == LVAL_SEXPR) { 
-        return lval_eval_sexpr(e, v);
+
+    if (lvm_direct(e, f, a->count) && a->rc == 1) {
+        lval* x;
+        if (ljit_call(e, f, a->cell, a->count, &x)) {
+            lval_del(a);
+            return x;
+        }
+        x = lvm_invoke(e, f, a->cell, a->count);
+        a->count = 0;
+        lval_del(a);
+        return x;
     }
 
-    return v;
+    /* a call short of arguments returns f with them added to its own,
+       f itself is shared and never changed */
+    lval* formals = f->fun->formals;
+    int bound = lval_bound(f);
+    int given = a->count;
+    int total = formals->count - bound;
+
+    int partial = given < total;
+    for (int i = bound; partial && i <= bound + given; i++) {
+        if (formals->cell[i]->sym == lsym_amp) { partial = 0; }
+    }
+    if (partial) {
+        lval* p = lval_clone(f);
+        p->fun->args = p->fun->args ? lval_join(p->fun->args, a) : a;
+        if (!p->arena) { lval_adopt(p); }
+        return p;
+    }
+
+    lenv* frame = lenv_copy(f->fun->env);
+    for (int i = 0; i < bound; i++) {
+        lenv_put(frame, formals->cell[i], f->fun->args->cell[i]);
+    }
+
+    int i = bound;
+    for (int j = 0; j < given; j++) {
+        if (i == formals->count) {
+            lval_del(a); lenv_del(frame);
+            return lval_err("Function passed too many arguments. Got %i, Expected %i", given, total);
+        }
+
+        if (formals->cell[i]->sym == lsym_amp) {
+            if (formals->count - i != 2) {
+                lval_del(a); lenv_del(frame);
+                return lval_err("Function format invalid. Symbol '&' not followed by single symbol");
+            }
+
+            lval* rest = lval_qexpr();
+            for (; j < given; j++) { rest = lval_add(rest, lval_ref(a->cell[j])); }
+            lenv_put(frame, formals->cell[i + 1], rest);
+            lval_del(rest);
+            i += 2;
+            break;
+        }
+
+        lenv_put(frame, formals->cell[i++], a->cell[j]);
+    }
+
+    lval_del(a);
+
+    /* only an '&' can be left, it collects no arguments */
+    if (i < formals->count) {
+        if (formals->count - i != 2) {
+            lenv_del(frame);
+            return lval_err("Function format invalid. Symbol '&' not followed by single symbol.");
+        }
+
+        lval* val = lval_qexpr();
+        lenv_put(frame, formals->cell[i + 1], val);
+        lval_del(val);
+    }
+
+    frame->par = e;
+    if (lval_code(e, f)) { return lvm_run(frame, f->fun->code, 1); }
+
+    lval* x = builtin_eval(frame, &f->fun->body, 1);
+    lenv_del(frame);
+    return x;
+}
+
+lval* lval_walk(lenv* e, lval* v);
+
+/* the value of an S-expression with the elements v, which are only read.
+   A pure builtin on symbols and literals borrows them, otherwise their
+   values go on vm.stack, where lvm_call takes them */
+lval* lval_eval_sexpr(lenv* e, lval** v, int n) {
+    lval* err = lvm_nest_err();
+    if (err) { return err; }
+    vm.nest++;
+
+    lval* x = n > 1 && LTYPE(v[0]) == LVAL_SYM ? lvm_borrow(e, v, n) : NULL;
+    if (x) {
+        vm.nest--;
+        return x;
+    }
+
+    int base = vm.sp;
+    for (int i = 0; i < n; i++) {
+        x = lval_walk(e, v[i]);
+        lvm_reserve(1);
+        vm.stack[vm.sp++] = x;
+    }
+    vm.sp = base;
+
+    x = lvm_call(e, vm.stack + base, n);
+    vm.nest--;
+    return x;
+}
+
+/* evaluates v without consuming or changing it, so the tree a function
+   holds is walked as it is on every call */
+lval* lval_walk(lenv* e, lval* v) {
+    /* evaluate Sexpressions */
+    if (LTYPE(v) == LVAL_SYM) { return lenv_lookup(e, v); }
+    if (LTYPE(v) == LVAL_SEXPR) { return lval_eval_sexpr(e, v->cell, v->count); }
+
+    return lval_ref(v);
+}
+
+lval* lval_eval(lenv* e, lval* v) {
+    lval* x = lval_walk(e, v);
+    lval_del(v);
+    return x;
 }
 
 lval* lval_read_num(mpc_ast_t* t) {
@@ -834,11 +3593,14 @@ lval* lval_read(mpc_ast_t* t) {
         x = lval_add(x, lval_read(t->children[i]));
     }
 
+    if (lcons_on && x->type == LVAL_QEXPR) { x = lval_cons(x); }
     return x;
 }
 
 int main(int argc, char** argv)
 {
+    lvm_cstack(&argc);
+
     /* Create some Parsers */
     Number    = mpc_new("number");
     Symbol    = mpc_new("symbol");
@@ -864,6 +3626,9 @@ int main(int argc, char** argv)
         ",
     Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
 
+    lsym_amp = lsym_intern("&");
+    lsym_if = lsym_intern("if");
+
     lenv* e = lenv_new();
     lenv_add_builtins(e);
 
@@ -875,14 +3640,18 @@ int main(int argc, char** argv)
         while (1)
         {
             char* input = readline("lispy> ");
+            if (input == NULL) { putchar('\n'); break; }
             add_history(input);
 
             mpc_result_t r;
             if (mpc_parse("<stdin>", input, Lispy, &r)) {
      
+                int region = larena_begin();
                 lval* x = lval_eval(e, lval_read(r.output));
                 lval_println(x);
                 lval_del(x);
+                larena_end(region);
+                lgc_safepoint(e);
 
                 mpc_ast_delete(r.output);
             } else {
@@ -898,14 +3667,19 @@ int main(int argc, char** argv)
 
     if (argc >= 2) {
         for (int i = 1; i < argc; i++) {
-            lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
-            lval* x = builtin_load(e, args);
-            if (x->type == LVAL_ERR) { lval_println(x); }
+            lval* path = lval_str(argv[i]);
+            lval* x = builtin_load(e, &path, 1);
+            if (LTYPE(x) == LVAL_ERR) { lval_println(x); }
             lval_del(x);
+            lval_del(path);
         }
     }
 
+    lgc_cleanup(e);
     lenv_del(e);
+    lcons_cleanup();
+    lpool_cleanup();
+    lsym_cleanup();
 
     /* Undefine and delete our Parsers */
     mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
@@ -0,0 +1,20 @@
+# runs LISPY on INPUT, a script to load or a session to type at the prompt,
+# and fails unless the output matches EXPECTED
+if(INPUT MATCHES "\\.in$")
+    execute_process(COMMAND ${LISPY}
+        INPUT_FILE ${INPUT}
+        OUTPUT_VARIABLE output ERROR_VARIABLE output
+        RESULT_VARIABLE result)
+else()
+    execute_process(COMMAND ${LISPY} ${INPUT}
+        OUTPUT_VARIABLE output ERROR_VARIABLE output
+        RESULT_VARIABLE result)
+endif()
+
+file(READ ${EXPECTED} expected)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${INPUT} exited with ${result}\n${output}")
+endif()
+if(NOT output STREQUAL expected)
+    message(FATAL_ERROR "${INPUT} output differs\n--- expected\n${expected}\n--- got\n${output}")
+endif()